@@ -7,14 +7,39 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <stdarg.h>
+#include <time.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/resource.h>
+#include "parsercodegen.h"
 
 #define MAX_IDENTIFIER_LENGTH 11
 #define MAX_NUMBER_LENGTH 5
 #define MAX_BUFFER_LENGTH 1000
-#define MAX_SYMBOL_TABLE_SIZE 500
-#define MAX_INSTRUCTION_LENGTH MAX_SYMBOL_TABLE_SIZE
+#define MAX_SYMBOL_TABLE_SIZE 500    // Initial capacity of the symbol table
+#define MAX_INSTRUCTION_LENGTH 500   // Default limit on the number of instructions (see --max-code)
+#define MAX_LOOKAHEAD 4              // Most tokens the parser may peek past the current one
+#define OUTPUT_FLUSH_SIZE (1 << 20)  // Pending output size that triggers a flush
+#define OBJECT_MAGIC "PL0B"          // First bytes of a binary object file
+#define OBJECT_VERSION 2             // Version of the binary object format, 2 since it may hold opcodes 10 to 16
+#define OBJECT_BYTE_ORDER 0x01020304 // Written in host byte order so a reader can detect a mismatch
+#define VM_STACK_SIZE (1 << 16)      // Num of stack slots available to a running program
+#define DATAFLOW_LIMIT (1 << 24)     // Most basic block and address pairs a dataflow pass tracks before skipping a program
+#define VALUE_UNSET 0                // Address state in replace_constant_loads: no path reaches it yet
+#define VALUE_CONSTANT 1             // Every path so far stores the same constant
+#define VALUE_VARYING 2              // The value isn't known
+#define LEXER_ERROR PL0_LEXER_ERROR  // Status of a compilation the scanner stopped, after the parser's error codes
+#define LEX_SAMPLE_RATE 64           // With --stats, one token in this many is timed to estimate the scanner's time
+#define CACHE_VERSION 1              // Bump whenever the code generated for a source or the cache entry layout changes
 
 // Define an enumeration for token types
 typedef enum
@@ -50,13 +75,62 @@ typedef enum
   readsym,      // Represents the 'read' keyword
 } token_type;
 
+// Spelling of each fixed token type, indexed by token_type
+const char *token_spelling[] = {
+    "", "odd", "", "", "+", "-", "*", "/", "=", "<>", "<", "<=", ">", ">=", "(", ")",
+    ",", ";", ".", ":=", "begin", "end", "if", "then", "while", "do", "const", "var",
+    "write", "read"};
+
+// Character classes used by the scanner, indexed by unsigned char
+#define DIGIT_CHAR 1   // '0' - '9'
+#define ALPHA_CHAR 2   // 'a' - 'z' and 'A' - 'Z'
+#define SPECIAL_CHAR 4 // Characters that start a special symbol or are rejected as invalid symbols
+
+const unsigned char char_class[256] = {
+    ['0' ... '9'] = DIGIT_CHAR,
+    ['a' ... 'z'] = ALPHA_CHAR,
+    ['A' ... 'Z'] = ALPHA_CHAR,
+    ['+'] = SPECIAL_CHAR, ['-'] = SPECIAL_CHAR, ['*'] = SPECIAL_CHAR, ['/'] = SPECIAL_CHAR,
+    ['('] = SPECIAL_CHAR, [')'] = SPECIAL_CHAR, ['='] = SPECIAL_CHAR, [','] = SPECIAL_CHAR,
+    ['.'] = SPECIAL_CHAR, ['<'] = SPECIAL_CHAR, ['>'] = SPECIAL_CHAR, [':'] = SPECIAL_CHAR,
+    [';'] = SPECIAL_CHAR, ['&'] = SPECIAL_CHAR, ['%'] = SPECIAL_CHAR, ['!'] = SPECIAL_CHAR,
+    ['@'] = SPECIAL_CHAR, ['#'] = SPECIAL_CHAR, ['$'] = SPECIAL_CHAR, ['?'] = SPECIAL_CHAR,
+    ['^'] = SPECIAL_CHAR, ['`'] = SPECIAL_CHAR, ['~'] = SPECIAL_CHAR, ['|'] = SPECIAL_CHAR};
+
+// Token type of each special character on its own (0 if it isn't a valid symbol by itself)
+const unsigned char single_symbols[256] = {
+    ['+'] = plussym, ['-'] = minussym, ['*'] = multsym, ['/'] = slashsym,
+    ['('] = lparentsym, [')'] = rparentsym, [','] = commasym, [';'] = semicolonsym,
+    ['.'] = periodsym, ['='] = eqsym, ['<'] = lessym, ['>'] = gtrsym};
+
 // Struct to represent token
 typedef struct
 {
-  char lexeme[MAX_BUFFER_LENGTH + 1]; // String representation of token (Ex: "+", "-", "end")
-  char value[MAX_BUFFER_LENGTH + 1];  // Value/Type of token
+  token_type type; // Type of token
+  int value;       // Decoded value for numbers, interned name id for identifiers, 0 otherwise
 } token;
 
+// Identifier names are stored once in an intern table and referred to by id
+typedef struct
+{
+  char *chars;        // Text of every interned name, each null terminated
+  int chars_size;     // Num of chars used
+  int chars_capacity; // Capacity of chars
+  int *offsets;       // Offset of each name's text within chars, indexed by id
+  int count;          // Num of interned names
+  int capacity;       // Capacity of offsets
+  int *slots;         // Open-addressing hash table of ids (-1 if empty)
+  int slot_capacity;  // Num of hash slots, always a power of two
+} intern_table;
+
+_Thread_local intern_table names; // Global intern table for identifier names
+
+typedef struct
+{
+  const char *cur; // Next character to scan
+  const char *end; // One past the last character of the source
+} lexer;
+
 typedef struct
 {
   token *tokens; // Pointer to array of token structs
@@ -64,16 +138,31 @@ typedef struct
   int capacity;  // Capacity of list
 } list;
 
-list *token_list; // Global pointer to list that holds all tokens
+_Thread_local list *token_list; // Global pointer to list that holds all tokens
+
+typedef struct
+{
+  list *source;               // List of tokens produced by the scanner (two-phase mode), NULL when pulling from lx
+  int pos;                    // Index of the next token to hand out from source
+  lexer *lx;                  // Lexer tokens are pulled from on demand when source is NULL
+  token ahead[MAX_LOOKAHEAD]; // Tokens already pulled from lx but not yet handed out
+  int num_ahead;              // Num of tokens in ahead
+} token_stream;
+
+_Thread_local token_stream stream; // Tokens consumed by the parser
+_Thread_local token current_token; // Keep track of current token
+token end_of_input = {0};          // Handed out once the token stream is exhausted (type 0 never matches a token type)
 
 typedef struct
 {
-  int kind;      // const = 1, var = 2, proc = 3
-  char name[10]; // name up to 11 chars
-  int val;       // number (ASCII value)
-  int level;     // L level
-  int addr;      // M address
-  int mark;      // to indicate unavailable or deleted
+  int kind;                             // const = 1, var = 2, proc = 3
+  char name[MAX_IDENTIFIER_LENGTH + 1]; // name up to 11 chars
+  int val;                              // number (ASCII value)
+  int level;                            // L level
+  int addr;                             // M address
+  int mark;                             // to indicate unavailable or deleted
+  int name_id;                          // interned id of name
+  int shadowed;                         // index of the previous symbol with the same name (-1 if none)
 } symbol;
 
 typedef struct
@@ -83,70 +172,526 @@ typedef struct
   int m;  // M
 } instruction;
 
-FILE *input_file;                           // Input file pointer
-FILE *output_file;                          // Output file pointer
-symbol symbol_table[MAX_SYMBOL_TABLE_SIZE]; // Global symbol table
-instruction code[MAX_INSTRUCTION_LENGTH];   // Global code array
-int cx = 0;                                 // Code index
-int tx = 0;                                 // Symbol table index
-int level = 0;                              // Current level
+// Binary object file layout: an object_header, then num_instructions packed instruction records (so the code can be
+// mapped and executed in place), then num_symbols object_symbol records
+typedef struct
+{
+  char magic[4];        // OBJECT_MAGIC (not null terminated)
+  int version;          // OBJECT_VERSION
+  int byte_order;       // OBJECT_BYTE_ORDER
+  int num_instructions; // Num of instruction records after the header
+  int num_symbols;      // Num of symbol records after the instructions (0 if the symbol table was left out)
+} object_header;
+
+typedef struct
+{
+  int kind;                             // const = 1, var = 2, proc = 3
+  char name[MAX_IDENTIFIER_LENGTH + 1]; // null terminated name
+  int val;                              // number (ASCII value)
+  int level;                            // L level
+  int addr;                             // M address
+  int mark;                             // to indicate unavailable or deleted
+} object_symbol;
+
+// Kinds of syntax tree nodes, with what each uses its fields for
+typedef enum
+{
+  ast_number = 1, // a: value (constants are replaced by their value)
+  ast_variable,   // a: symbol index
+  ast_operation,  // op: OPR M of an arithmetic or comparison operator, a: left operand, b: right operand
+  ast_odd,        // op: OPR M of ODD, a: operand
+  ast_assign,     // a: symbol index of the variable, b: expression
+  ast_begin,      // a: first statement (-1 if none), linked to the rest through next
+  ast_if,         // a: condition, b: statement (-1 if empty)
+  ast_while,      // a: condition, b: statement (-1 if empty)
+  ast_read,       // a: symbol index of the variable
+  ast_write,      // a: expression
+  ast_block,      // a: num of variables, b: statement (-1 if empty)
+  ast_temporary,  // a: address of a temporary the optimizer added, loaded as an expression
+  ast_save,       // a: address of a temporary, b: expression to store in it
+} ast_kind;
+
+// Syntax tree node. Every node lives in the ast array and refers to others by index, -1 for none
+typedef struct
+{
+  unsigned char kind; // ast_kind
+  unsigned char op;   // OPR M for operations
+  int a;              // First field, see ast_kind
+  int b;              // Second field, see ast_kind
+  int next;           // Next statement in a begin block (-1 if last)
+} ast_node;
+
+// While loop being optimized by hoist_loop
+typedef struct
+{
+  char *stored;     // 1 for each address the loop stores to
+  int *hoisted;     // Expressions moved out of the loop
+  int *temporaries; // Address of the temporary holding each of them
+  int num_hoisted;  // Num of expressions moved out of the loop
+  int capacity;     // Capacity of hoisted and temporaries
+} loop_info;
+
+// Operation computed in a straight-line run of statements, see value_table
+typedef struct
+{
+  int node;      // Operation's node
+  int value;     // Value number of what it computes
+  int statement; // Index in the run of the statement computing it
+  int first;     // Index of the first operation in its operands, which are all recorded just before it
+  int removed;   // 1 once it no longer runs because an expression around it was replaced by a temporary
+  int next;      // Next operation in the run with the same value number (-1 if last)
+} value_use;
+
+// Value numbers of the expressions in straight-line runs of statements, for eliminate_common_subexpressions. Two
+// expressions get the same number when they apply the same operator to operands with the same numbers, and a variable
+// gets a new number each time it is stored, so within a run the same number always means the same value
+typedef struct
+{
+  int *keys;              // Kind, op, and operand numbers (or address and store stamp) of each value, 4 ints each
+  int *sizes;             // Num of instructions that compute each value
+  char *constant;         // 1 for each value made only of numbers
+  int *uses;              // First operation in the run computing each value (-1 if none)
+  int *last_use;          // Last operation in the run computing each value
+  int *num_uses;          // Num of operations in the run computing each value
+  int num_values;         // Num of values numbered
+  int value_capacity;     // Capacity of the arrays above
+  int *slots;             // Open-addressing hash table of value numbers (-1 if empty)
+  int slot_capacity;      // Num of hash slots, always a power of two
+  int *stamps;            // Stamp of the last store to each address
+  int clock;              // Last stamp handed out
+  int *run;               // Statements in the run, in the order they run
+  int run_size;           // Num of statements in run
+  int run_capacity;       // Capacity of run
+  value_use *operations;  // Operations the run computes, in the order they are computed
+  int num_operations;     // Num of operations in operations
+  int operation_capacity; // Capacity of operations
+  int *candidates;        // Size and value number of each value computed more than once in the run, 2 ints each
+  int num_candidates;     // Num of candidates
+  int candidate_capacity; // Capacity of candidates
+} value_table;
+
+// Basic block of the code: a run of instructions that is only entered at its first one and only left after its last
+typedef struct
+{
+  int start;     // Index of the first instruction
+  int end;       // One past the index of the last instruction
+  int next;      // Block that runs next when the last instruction falls through (-1 if it can't)
+  int target;    // Block the last instruction jumps or branches to (-1 if it doesn't)
+  int reachable; // 1 if the block can run, starting from the first block
+} basic_block;
+
+// Peephole rule over a window of consecutive instructions starting at code[i]. apply rewrites the window in place,
+// marking removed instructions with op 0, and returns 1 if the rule changed anything
+typedef struct
+{
+  const char *name;    // Name that selects the rule in --peephole=
+  int window;          // Num of instructions the rule looks at
+  int (*apply)(int i); // Try the rule on the window starting at code[i]
+  int enabled;         // 1 if the rule runs
+  int applied;         // Num of times the rule changed the code
+  int removed;         // Num of instructions the rule removed
+} peephole_rule;
+
+typedef struct batch_info batch_info;
+
+// Worker thread of --batch with its deque of files to compile, which are the indexes from top to bottom - 1. The worker
+// takes from the bottom and other workers steal from the top
+typedef struct
+{
+  batch_info *batch;    // Batch the worker belongs to
+  int index;            // Index of the worker in the batch
+  pthread_t thread;     // Thread running the worker (unused for the main thread, which is worker 0)
+  pthread_mutex_t lock; // Guards top and bottom
+  int top;              // Next file for another worker to steal
+  int bottom;           // One past the next file for this worker to take
+  int compiled;         // Num of files the worker compiled
+  int stolen;           // Num of them it stole from other workers
+} batch_worker;
+
+// Files being compiled by --batch
+struct batch_info
+{
+  char **inputs;              // Path of each input file
+  char **outputs;             // Path of each output file
+  int num_files;              // Num of pairs of files
+  int *statuses;              // Result of compile_file for each pair
+  batch_worker *workers;      // Worker threads
+  int num_workers;            // Num of workers
+  const peephole_rule *rules; // Peephole rules as the main thread selected them
+};
+
+// Entry of the --cache directory, while trim_cache decides which to remove
+typedef struct
+{
+  char name[64]; // File name within the directory
+  off_t size;    // Size of the file in bytes
+  double used;   // Last time the entry was written or hit, in seconds
+} cache_file;
+
+// Connection to the --serve socket, answered by its own thread
+typedef struct
+{
+  int socket;                 // Connected socket
+  const peephole_rule *rules; // Peephole rules as the main thread selected them
+} server_connection;
+
+// Native code being generated by run_jit
+typedef struct
+{
+  unsigned char *bytes; // Machine code generated so far
+  int size;             // Num of bytes generated
+  int capacity;         // Capacity of bytes
+} jit_buffer;
+
+// State of the compilation in progress, like names, token_list, stream and current_token above. It is thread local so
+// each --batch worker thread runs its own compilations
+_Thread_local FILE *input_file;           // Input file pointer
+_Thread_local char *source;               // Contents of the input file
+_Thread_local size_t source_length = 0;   // Num of chars in source
+_Thread_local int source_mapped = 0;      // 1 if source is mmapped, 0 if it was read into a malloc'd buffer
+_Thread_local FILE *output_file;          // Output file pointer
+_Thread_local char *output_buffer;        // Formatted output waiting to be written to the console and output file
+_Thread_local size_t output_size = 0;     // Num of chars in output_buffer
+_Thread_local size_t output_capacity = 0; // Capacity of output_buffer
+_Thread_local symbol *symbol_table;       // Global symbol table
+_Thread_local int symbol_capacity = 0;    // Capacity of symbol table
+_Thread_local int *scope_heads;           // Newest symbol index for each interned name id (-1 if none)
+_Thread_local int scope_capacity = 0;     // Capacity of scope_heads
+_Thread_local instruction *code;          // Global code array
+_Thread_local int code_capacity = 0;      // Capacity of code array
+_Thread_local int cx = 0;                 // Code index
+_Thread_local int tx = 0;                 // Symbol table index
+_Thread_local int level = 0;              // Current level
+_Thread_local ast_node *ast;              // Syntax tree built by the parser
+_Thread_local int ast_size = 0;           // Num of nodes in ast
+_Thread_local int ast_capacity = 0;       // Capacity of ast
+_Thread_local int *chain;                 // Operations waiting for code while generating a chain like a - b - c
+_Thread_local int chain_size = 0;         // Num of operations in chain
+_Thread_local int chain_capacity = 0;     // Capacity of chain
+_Thread_local int program_vars = 0;       // Num of variables the program declares
+_Thread_local int num_temporaries = 0;    // Num of stack slots after the variables reserved for the optimizer's temporaries
+_Thread_local int capture_output = 0;     // 1 to keep output in output_buffer instead of writing it (pl0_compile, --serve)
+_Thread_local pl0_error last_error;       // Why the last compilation stopped, for pl0_compile
+
+// Options set from the command line
+int lex_only = 0;                      // --lex-only: stop after scanning the input
+int two_phase = 0;                     // --two-phase: scan the whole input into token_list before parsing
+int max_code = MAX_INSTRUCTION_LENGTH; // --max-code=N: most instructions a program may compile to (0 for no limit)
+int max_symbols = 0;                   // --max-symbols=N: most entries the symbol table may hold (0 for no limit)
+int quiet = 0;                         // --quiet: write output only to the output file, not the console
+const char *binary_path = NULL;        // --binary=FILE: also write the code as a binary object file
+int strip_symbols = 0;                 // --strip-symbols: leave the symbol table out of the binary object file
+int from_binary = 0;                   // --from-binary: the input file is a binary object file to list instead of source
+int run_program = 0;                   // --run: execute the code after listing it
+int jit_enabled = 0;                   // --jit: run the code as native machine code instead of interpreting it
+int show_stats = 0;                    // --stats[=json]: report statistics on stderr
+int stats_json = 0;                    // --stats=json: report them as a JSON object on one line
+int fold_constants = 0;                // --fold-constants: compute operations on compile-time constants while compiling
+int peephole_enabled = 0;              // --peephole[=RULES]: run the peephole pass over the code after compiling
+int fuse_branches = 0;                 // --fuse-branches: compile a comparison feeding a JPC into one branch instruction
+int hoist_invariants_enabled = 0;      // --hoist-invariants: compute values that don't change in a loop before it
+int common_subexprs_enabled = 0;       // --common-subexprs: compute an expression repeated in straight-line code once
+int dead_stores_enabled = 0;           // --dead-stores: remove stores whose value is never loaded
+int constant_loads_enabled = 0;        // --constant-loads: replace loads of a variable known to hold a constant
+int remove_dead = 0;                   // --remove-dead-code: remove basic blocks that can never run
+const char *cfg_path = NULL;           // --dump-cfg=FILE: write the control flow graph of the code to FILE
+const char *c_path = NULL;             // --emit-c=FILE: also write the program to FILE as C
+const char *batch_path = NULL;         // --batch=FILE: compile every pair of input and output files listed in FILE
+int num_jobs = 0;                      // --jobs=N: num of worker threads for --batch (0 for one per CPU)
+int serve_enabled = 0;                 // --serve[=SOCKET]: answer compile requests until the input ends
+const char *serve_path = NULL;         // Unix socket --serve listens on (NULL for stdin and stdout)
+const char *cache_dir = NULL;          // --cache=DIR: reuse the code compiled earlier from the same source and options
+int cache_megabytes = 64;              // --cache-size=N: most megabytes the cache directory may hold before trimming
+_Thread_local jmp_buf *error_jump;     // Where an error returns to in compile_file (NULL to exit instead)
+
+// Statistics reported by --stats
+long long vm_executed = 0;                             // Num of instructions executed by the VM
+_Thread_local int folded_operations = 0;               // Num of operations replaced by their constant result
+_Thread_local int hoisted_expressions = 0;             // Num of loop invariant expressions replaced by a temporary
+_Thread_local int common_subexpressions = 0;           // Num of repeated expressions replaced by a load of a temporary
+_Thread_local int common_operations_removed = 0;       // Num of operations they no longer compute
+_Thread_local int dead_stores_removed = 0;             // Num of stores removed because their value was never loaded
+_Thread_local int dead_store_instructions_removed = 0; // Num of instructions removed with them
+_Thread_local int constant_loads_replaced = 0;         // Num of loads replaced by a LIT of the constant they load
+_Thread_local int dead_blocks_removed = 0;             // Num of unreachable basic blocks removed
+_Thread_local int dead_instructions_removed = 0;       // Num of instructions in them
+int cache_hits = 0;                                    // Num of compilations loaded from the cache
+int cache_misses = 0;                                  // Num of compilations the cache didn't have
+_Thread_local double read_seconds = 0;                 // Wall clock time spent reading the input file
+_Thread_local double lex_seconds = 0;                  // Wall clock time spent in the scanner
+_Thread_local double parse_seconds = 0;                // Wall clock time spent parsing and generating code, less the scanner's
+_Thread_local double optimize_seconds = 0;             // Wall clock time spent in the optimizations after parsing
+_Thread_local double output_seconds = 0;               // Wall clock time spent formatting and writing output
+_Thread_local long long tokens_scanned = 0;            // Num of tokens the scanner produced
+_Thread_local long long tokens_pulled = 0;             // Num of tokens the parser pulled from the scanner, see pull_token
+_Thread_local long long symbol_lookups = 0;            // Num of check_symbol_table calls
+_Thread_local long long symbols_compared = 0;          // Num of symbol table entries they looked at
+_Thread_local long long names_compared = 0;            // Num of identifier names compared with strncmp while interning
+_Thread_local long long instructions_generated = 0;    // Num of instructions emitted, before optimizing removes any
+_Thread_local long long bytes_written = 0;             // Num of bytes of listing and binary object written
+double clock_overhead = 0;                             // Time taken by a pair of now_seconds calls, measured for --stats
+double vm_seconds = 0;                                 // Wall clock time spent in the VM (or translating and running native code)
+int jit_size = 0;                                      // Num of bytes of native code run by the JIT (0 if the code was interpreted)
 
 // Function prototypes
-char peekc();
+int parse_option(const char *option);
+int compile_source(const char *input_path);
+int compile_program();
+void open_source(lexer *lx);
+void create_compiler_state();
+void reset_compiler_state();
+void destroy_compiler_state();
+int compile_file(const char *input_path, const char *output_path);
+int compile_batch(const char *list_path);
+void *batch_worker_main(void *arg);
+int take_job(batch_info *batch, int index);
+void describe_token(token t, char *text, size_t size);
+int serve(const char *path);
+void *serve_connection(void *arg);
+int serve_stream(FILE *in, FILE *out);
+int serve_request(char *text, size_t length, int binary);
+int parse_count(const char *text, int *count);
 void print_both(const char *format, ...);
+void reserve_output(size_t length);
+void append_output(const char *text, size_t length);
+void append_padded_int(int value, int width);
+void append_padded_string(const char *text, int width);
+void flush_output();
 void print_source_code();
-void clear_to_index(char *str, int index);
-int handle_reserved_word(char *buffer);
-int handle_special_symbol(char *buffer);
-int is_special_symbol(char c);
+int load_source(FILE *file);
+void unload_source();
+void open_lexer(lexer *lx, const char *text, size_t length);
+int scan_token(lexer *lx, token *t);
+void lexer_error(const char *text, int length, const char *message);
+int handle_reserved_word(const char *word, int length);
+int handle_special_symbol(char c, char nextc, int *length);
 list *create_list();
 list *destroy_list(list *l);
 list *append_token(list *l, token t);
 void add_token(list *l, token t);
+token make_token(token_type type, int value);
+void create_intern_table(intern_table *table);
+void destroy_intern_table(intern_table *table);
+void reset_intern_table(intern_table *table);
+unsigned int hash_name(const char *name, int length);
+int intern_name(intern_table *table, const char *name, int length);
+const char *interned_name(intern_table *table, int id);
 void print_lexeme_table(list *l);
 void print_tokens(list *l);
 
 // Parser/Codegen function prototypes
+void open_stream(token_stream *s, list *source);
+void open_lexer_stream(token_stream *s, lexer *lx);
+int pull_token(lexer *lx, token *t);
+token *peek_token(token_stream *s, int offset);
 void get_next_token();
+void create_code_buffer();
+void destroy_code_buffer();
+void reserve_code(int count);
 void emit(int op, int l, int m);
 void error(int error_code);
-int check_symbol_table(char *string);
-void add_symbol(int kind, char *name, int val, int level, int addr, int mark);
-void program();
-void block();
+void stop_compiling(int status);
+void create_symbol_table();
+void destroy_symbol_table();
+int check_symbol_table(int name_id);
+void add_symbol(int kind, int name_id, int val, int level, int addr, int mark);
+int program();
+int block();
 void const_declaration();
 int var_declaration();
-void statement();
-void condition();
-void expression();
-void term();
-void factor();
+int statement();
+int condition();
+int expression();
+int term();
+int factor();
+int new_node(int kind, int op, int a, int b);
+void generate_program(int root);
+void generate_statement(int node);
+void push_chain(int node);
+int generate_expression(int node);
+void hoist_loop_invariants(int root);
+void hoist_statement(int node);
+void hoist_loop(int node);
+void mark_stores(int node, loop_info *loop);
+void hoist_from_statement(int node, loop_info *loop);
+int hoist_invariants(int node, int always_runs, loop_info *loop);
+void hoist_if_worthwhile(int node, int always_runs, loop_info *loop);
+int same_expression(int x, int y);
+int is_constant_expression(int node);
+int can_fail(int node);
+void eliminate_common_subexpressions(int root);
+void number_statement(int node, value_table *table);
+void eliminate_in_run(value_table *table);
+int number_expression(int node, int statement, value_table *table);
+int find_value(value_table *table, int kind, int op, int x, int y, int size, int constant);
+unsigned int hash_value(int kind, int op, int x, int y);
+int compare_candidates(const void *x, const void *y);
+int emit_operation(int m, int constant_operands);
+int fold_operation(int m, int a, int b, int *result);
+int emit_false_jump();
+int jump_target(int i);
+int peephole();
+void remove_marked_instructions();
+int build_cfg(basic_block **blocks);
+int ends_block(int i);
+int eliminate_dead_code();
+int count_addresses();
+int pure_producer(int start, int i);
+int remove_dead_stores();
+int replace_constant_loads();
+void optimize_code();
+int write_cfg(const char *path);
+int write_c(int root, const char *path);
+void write_c_statement(FILE *file, int node, int depth);
+void write_c_expression(FILE *file, int node);
+int peephole_jump_next(int i);
+int peephole_jump_chain(int i);
+int peephole_identity(int i);
+int peephole_load_store(int i);
+int peephole_constant_branch(int i);
+int select_peephole_rules(const char *names);
 void print_symbol_table();
 void print_instructions();
 void get_op_name(int op, char *name);
+int write_object(const char *path);
+void append_object(int include_symbols);
+int load_object(const char *data, size_t length);
+void cache_entry(char *path, size_t path_size, char *prefix, size_t prefix_size);
+int lookup_cache();
+void store_cache();
+void trim_cache();
+int compare_cache_files(const void *x, const void *y);
+unsigned long long hash_bytes(unsigned long long hash, const char *bytes, size_t length);
+double now_seconds();
+void print_stats();
+void print_stats_json();
+double stats_clock();
+void measure_clock_overhead();
+
+// Peephole rules, run in this order at each instruction. Each thread has its own copy for its counts, see batch_worker
+_Thread_local peephole_rule peephole_rules[] = {
+    {"jump-chain", 1, peephole_jump_chain, 0, 0, 0},           // Jump to a JMP goes straight to its target
+    {"jump-next", 1, peephole_jump_next, 0, 0, 0},             // JMP to the next instruction is removed
+    {"identity", 2, peephole_identity, 0, 0, 0},               // LIT 0; ADD/SUB and LIT 1; MUL/DIV are removed
+    {"load-store", 2, peephole_load_store, 0, 0, 0},           // LOD x; STO x is removed
+    {"constant-branch", 2, peephole_constant_branch, 0, 0, 0}, // LIT c; JPC becomes JMP if c is 0, otherwise it's removed
+};
+#define NUM_PEEPHOLE_RULES (int)(sizeof(peephole_rules) / sizeof(peephole_rules[0]))
 
+// VM function prototypes
+int run_vm(const instruction *program, int length);
+int vm_base(const int *stack, int bp, int l);
+int vm_read(int *value);
+void vm_write(int value);
+
+// JIT function prototypes
+int run_jit(const instruction *program, int length);
+int jit_check(const instruction *program, int length, int *depth, char *target);
+void jit_bytes(jit_buffer *buffer, int count, ...);
+void jit_int(jit_buffer *buffer, int value);
+void jit_jump(jit_buffer *buffer, int **jumps, int *num_jumps, int *capacity, int to);
+void jit_spill(jit_buffer *buffer, int index);
+void jit_reload(jit_buffer *buffer, int values, int index);
+void jit_call(jit_buffer *buffer, void *function);
+
+#ifndef PL0_LIBRARY
 int main(int argc, char *argv[])
 {
-  if (argc != 3)
+  // Split arguments into options and the input/output file paths
+  char *paths[2];
+  int num_paths = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strncmp(argv[i], "--", 2) == 0)
+    {
+      if (!parse_option(argv[i]))
+        num_paths = -1; // Unknown option
+    }
+    else if (num_paths >= 0 && num_paths < 2)
+      paths[num_paths++] = argv[i];
+    else
+      num_paths = -1; // Too many paths
+    if (num_paths < 0)
+      break;
+  }
+
+  if (serve_enabled && num_paths == 0)
+    return serve(serve_path);
+
+  if (batch_path != NULL && num_paths == 0)
+  {
+    quiet = 1; // Many files at once would make a mess of the console
+    return compile_batch(batch_path);
+  }
+
+  if (num_paths != 2)
   {
-    print_both("Usage: %s <input file> <output file>\n", argv[0]);
+    print_both("Usage: %s [options] <input file> <output file>\n", argv[0]);
+    print_both("       %s [options] --batch=FILE\n", argv[0]);
+    print_both("       %s [options] --serve[=SOCKET]\n", argv[0]);
+    print_both("Options:\n");
+    print_both("  --lex-only         Scan the input and report the number of tokens without compiling\n");
+    print_both("  --two-phase        Scan the whole input into a token list before parsing it\n");
+    print_both("  --max-code=N       Allow programs of up to N instructions (default %d, 0 for no limit)\n", MAX_INSTRUCTION_LENGTH);
+    print_both("  --max-symbols=N    Allow up to N symbol table entries (default 0, no limit)\n");
+    print_both("  --quiet            Write output only to the output file, not the console\n");
+    print_both("  --binary=FILE      Also write the code and symbol table to FILE as a binary object\n");
+    print_both("  --emit-c=FILE      Also write the program to FILE as a C program that can be compiled natively\n");
+    print_both("  --strip-symbols    Leave the symbol table out of the binary object\n");
+    print_both("  --from-binary      Read the input file as a binary object and list it instead of compiling\n");
+    print_both("  --run              Execute the code after listing it, reading from stdin and writing to stdout\n");
+    print_both("  --jit              With --run, translate the code to x86-64 machine code and run that when possible\n");
+    print_both("  --batch=FILE       Compile each input and output file pair listed in FILE, one pair per line\n");
+    print_both("  --jobs=N           Compile --batch files on N threads (default one per CPU)\n");
+    print_both("  --serve[=SOCKET]   Answer compile requests on stdin, or on each connection to a Unix socket\n");
+    print_both("  --cache=DIR        Reuse the code compiled earlier from the same source and options, kept in DIR\n");
+    print_both("  --cache-size=N     Keep up to N megabytes in the --cache directory (default 64, 0 for no limit)\n");
+    print_both("  --stats[=json]     Report statistics on stderr, as one line of JSON with =json\n");
+    print_both("  --optimize         Turn on every optimization below\n");
+    print_both("  --fold-constants   Compute operations on constants while compiling\n");
+    print_both("  --fuse-branches    Compile a comparison that only decides a jump into a single branch instruction\n");
+    print_both("  --hoist-invariants Compute values that don't change in a loop once before it\n");
+    print_both("  --common-subexprs  Compute an expression repeated in straight-line code once and reuse it\n");
+    print_both("  --dead-stores      Remove stores whose value is never loaded\n");
+    print_both("  --constant-loads   Replace loads of a variable known to hold a constant with the constant\n");
+    print_both("  --remove-dead-code Remove code that can never run\n");
+    print_both("  --dump-cfg=FILE    Write the control flow graph to FILE, in Graphviz format if it ends in .dot\n");
+    print_both("  --peephole[=RULES] Simplify the code after compiling, with every rule or a comma separated list of:\n");
+    print_both("                    ");
+    for (int i = 0; i < NUM_PEEPHOLE_RULES; i++)
+      print_both(" %s", peephole_rules[i].name);
+    print_both("\n");
+    flush_output();
     return 1;
   }
 
-  input_file = fopen(argv[1], "r");
-  output_file = fopen(argv[2], "w");
+  input_file = fopen(paths[0], "r");
+  output_file = fopen(paths[1], "w");
 
   if (input_file == NULL)
   {
-    print_both("Error: Could not open input file %s\n", argv[1]);
+    print_both("Error: Could not open input file %s\n", paths[0]);
+    flush_output();
     exit(1);
   }
 
   if (output_file == NULL)
   {
-    print_both("Error: Could not open output file %s\n", argv[2]);
+    print_both("Error: Could not open output file %s\n", paths[1]);
+    flush_output();
+    exit(1);
+  }
+
+  if (show_stats)
+    measure_clock_overhead();
+  double read_start = stats_clock();
+  if (!load_source(input_file))
+  {
+    print_both("Error: Could not read input file %s\n", paths[0]);
+    flush_output();
     exit(1);
   }
+  read_seconds = stats_clock() - read_start;
 
   // print_both("Source Program:\n");
   // print_source_code();
@@ -155,969 +700,4357 @@ int main(int argc, char *argv[])
   // print_both("\n");
   // print_both("%10s %20s\n", "lexeme", "token type");
 
-  token_list = create_list();
+  create_compiler_state();
+  int root = compile_source(paths[0]);
 
-  char c;
-  char buffer[MAX_BUFFER_LENGTH + 1] = {0};
-  int buffer_index = 0;
+  double output_start = stats_clock();
+  if (c_path != NULL && root >= 0 && !write_c(root, c_path))
+  {
+    print_both("Error: Could not write C file %s\n", c_path);
+    flush_output();
+    exit(1);
+  }
 
-  while ((c = fgetc(input_file)) != EOF)
+  if (binary_path != NULL && !lex_only && !write_object(binary_path))
   {
-    if (iscntrl(c) || isspace(c)) // Skip control characters and whitespace
-    {
-      c = fgetc(input_file);
-    }
-    if (isdigit(c)) // Handle numbers
-    {
-      buffer[buffer_index++] = c;
-      while (1)
-      {
-        char nextc = peekc();
-        if (isspace(nextc) || is_special_symbol(nextc)) // If next character is a space or special symbol, we've reached the end of the number
-        {
-          token t;
-          if (buffer_index > MAX_NUMBER_LENGTH)
-          {
-            exit(1);
-            // Number is too long
-            // print_both("%10s %20s\n", buffer, "ERROR: NUMBER TOO LONG");
-          }
-          else
-          {
-            // Number is valid
-            // print_both("%10s %20d\n", buffer, numbersym);
-            sprintf(t.value, "%d", numbersym);
-            strcpy(t.lexeme, buffer);
-            append_token(token_list, t);
-          }
+    print_both("Error: Could not write binary file %s\n", binary_path);
+    flush_output();
+    exit(1);
+  }
 
-          // Clear buffer and break out of loop
-          clear_to_index(buffer, buffer_index);
-          buffer_index = 0;
-          break;
-        }
-        else if (isdigit(nextc))
-        {
-          // If next character is a digit, add it to the buffer
-          c = getc(input_file);
-          buffer[buffer_index++] = c;
-        }
-        else if (nextc == EOF) // This is the last character in the file
-          break;
-        else if (isalpha(nextc))
-        {
-          // Invalid number
-          token t;
-          // print_both("%10s %20d\n", buffer, numbersym);
-          sprintf(t.value, "%d", numbersym);
-          strcpy(t.lexeme, buffer);
-          append_token(token_list, t);
-          clear_to_index(buffer, buffer_index);
-          buffer_index = 0;
-          break;
-        }
-      }
-    }
-    else if (isalpha(c)) // Handle identifiers and reserved words
-    {
-      buffer[buffer_index++] = c;
-      while (1)
-      {
-        char nextc = peekc();
-        if (isspace(nextc) || is_special_symbol(nextc) || nextc == EOF) // If next character is a space or special symbol, we've reached the end of the identifier
-        {
-          // Check reserved words
-          int token_value = handle_reserved_word(buffer);
-          if (token_value)
-          {
-            token t;
-            // print_both("%10s %20d\n", buffer, token_value);
-            sprintf(t.value, "%d", token_value);
-            strcpy(t.lexeme, buffer);
-            append_token(token_list, t);
-            clear_to_index(buffer, buffer_index);
-            buffer_index = 0;
-            break;
-          }
-          else
-          {
-            // Identifier
-            token t;
-            if (buffer_index > MAX_IDENTIFIER_LENGTH) // Check if identifier is too long
-            {
-              exit(1);
-              // print_both("%10s %20s\n", buffer, "ERROR: IDENTIFIER TOO LONG");
-            }
-            else
-            {
-              // Valid identifier
-              // print_both("%10s %20d\n", buffer, identsym);
-              sprintf(t.value, "%d", identsym);
-              strcpy(t.lexeme, buffer);
-              append_token(token_list, t);
-            }
-
-            clear_to_index(buffer, buffer_index);
-            buffer_index = 0;
-            break;
-          }
-          break;
-        }
-        else if (isalnum(nextc)) // If next character is a letter or digit, add it to the buffer
-        {
-          c = getc(input_file);
-          buffer[buffer_index++] = c;
-        }
-      }
-    }
-    else if (is_special_symbol(c)) // Handle special symbols
-    {
-      buffer[buffer_index++] = c;
-      char nextc = peekc();
+  if (cfg_path != NULL && !lex_only && !write_cfg(cfg_path))
+  {
+    print_both("Error: Could not write control flow graph file %s\n", cfg_path);
+    flush_output();
+    exit(1);
+  }
 
-      if (is_special_symbol(nextc)) // Current character is special and so is the next
-      {
-        // Handle block comments
-        if (c == '/' && nextc == '*')
-        {
-          // Clear buffer
-          clear_to_index(buffer, buffer_index);
-          buffer_index = 0;
-          while (1) // Consume characters until we reach the end of the block comment
-          {
-            c = getc(input_file);
-            nextc = peekc();
-            if (c == '*' && nextc == '/')
-            {
-              c = getc(input_file);
-              break;
-            }
-          }
-          continue;
-        }
+  flush_output(); // Listing comes before anything the program writes
+  output_seconds += stats_clock() - output_start;
 
-        // Handle single line comments
-        if (c == '/' && nextc == '/')
-        {
-          // Clear buffer
-          clear_to_index(buffer, buffer_index);
-          buffer_index = 0;
-          while (1) // Consume characters until we reach the end of the line
-          {
-            c = getc(input_file);
-            nextc = peekc();
-            if (c == '\n')
-            {
-              break;
-            }
-          }
-          continue;
-        }
+  int exit_code = 0;
+  if (run_program && !lex_only)
+  {
+    double start = now_seconds();
+    exit_code = jit_enabled ? run_jit(code, cx) : -1;
+    if (exit_code < 0)
+      exit_code = run_vm(code, cx); // Code the JIT can't translate is interpreted
+    vm_seconds = now_seconds() - start;
+  }
 
-        // Handle special case where the second symbol is a semicolon
-        if (nextc == ';')
-        {
-          // Check if first symbol is a valid symbol
-          token t;
-          int token_value = handle_special_symbol(buffer);
-          if (!token_value)
-          {
-            exit(1);
-          }
+  flush_output(); // Write remaining output
+  if (show_stats)
+    print_stats();
 
-          // Append first symbol to token list
-          sprintf(t.value, "%d", token_value);
-          strcpy(t.lexeme, buffer);
-          append_token(token_list, t);
+  destroy_compiler_state(); // Free memory used by the compilation
+  unload_source();          // Release source buffer
+  fclose(input_file);       // Close input file
+  fclose(output_file);      // Close output file
+  return exit_code;
+}
+#endif
 
-          // Append semicolon to token list
-          sprintf(t.value, "%d", semicolonsym);
-          strcpy(t.lexeme, ";");
-          append_token(token_list, t);
+// Scan and parse the loaded source, then generate, optimize and list its code (or whatever less the options ask for).
+// Returns the root of the syntax tree, or -1 if the options stop short of parsing
+int compile_source(const char *input_path)
+{
+  lexer lx;
+  open_source(&lx);
 
-          clear_to_index(buffer, buffer_index);
-          buffer_index = 0;
+  if (lex_only)
+  {
+    // Count tokens by draining the stream (type 0 marks the end of input)
+    int num_tokens = 0;
+    for (get_next_token(); current_token.type != 0; get_next_token())
+      num_tokens++;
+    print_both("Tokens: %d\n", num_tokens);
+  }
+  else if (from_binary)
+  {
+    if (!load_object(source, source_length))
+    {
+      print_both("Error: %s is not a valid binary object file\n", input_path);
+      stop_compiling(1);
+    }
+    print_instructions();
+    print_symbol_table();
+  }
+  else
+  {
+    // print_both("\n");
+    // print_both("Token List:\n");
+    // print_tokens(token_list); // Print tokens to console and output file
+    // printf("\n");
 
-          continue;
-        }
+    // A cached compilation only has the code and symbol table, not the syntax tree --emit-c needs
+    int cached = cache_dir != NULL && c_path == NULL && lookup_cache();
+    int root = -1;
+    if (!cached)
+      root = compile_program();
+    if (cache_dir != NULL && c_path == NULL && !cached)
+      store_cache();
 
-        // We have two pontentially valid symbols, so we need to check if they make a valid symbol
-        c = getc(input_file);
-        buffer[buffer_index++] = c;
+    double start = stats_clock();
+    print_instructions();
+    print_symbol_table();
+    output_seconds += stats_clock() - start;
+    return root;
+  }
+  return -1;
+}
 
-        token t;
-        int token_value = handle_special_symbol(buffer);
-        if (!token_value)
-        {
-          // All symbols are invalid
-          // for (int i = 0; i < buffer_index; i++)
-          //   print_both("%10c %20s\n", buffer[i], "ERROR: INVALID SYMBOL");
-          exit(1);
-        }
-        else
-        {
-          // Both symbols make a valid symbol
-          // print_both("%10s %20d\n", buffer, token_value);
-          sprintf(t.value, "%d", token_value);
-          strcpy(t.lexeme, buffer);
-          append_token(token_list, t);
-        }
+// Point the token stream at the loaded source, scanning it all first with --two-phase
+void open_source(lexer *lx)
+{
+  token t;
+  open_lexer(lx, source, source_length);
+  if (two_phase)
+  {
+    // Scan the whole source buffer into the token list before parsing
+    double start = stats_clock();
+    while (scan_token(lx, &t))
+      append_token(token_list, t);
+    lex_seconds += stats_clock() - start;
+    tokens_scanned += token_list->size;
+    open_stream(&stream, token_list);
+  }
+  else
+  {
+    // Let the parser pull tokens from the lexer as it needs them
+    open_lexer_stream(&stream, lx);
+  }
+}
 
-        clear_to_index(buffer, buffer_index);
-        buffer_index = 0;
-      }
-      else
-      {
-        // Handle single special symbol
-        token t;
-        int token_value = handle_special_symbol(buffer);
-        if (!token_value)
-        {
-          exit(1);
-          // print_both("%10c %20s\n", c, "ERROR: INVALID SYMBOL");
-        }
-        else
-        {
-          // print_both("%10s %20d\n", buffer, token_value);
-          sprintf(t.value, "%d", token_value);
-          strcpy(t.lexeme, buffer);
-          append_token(token_list, t);
-        }
+// Parse the token stream into a syntax tree and generate and optimize its code, returning the root of the tree
+int compile_program()
+{
+  // Read in tokens from the token stream and parse them into a syntax tree
+  double start = stats_clock();
+  double lexed = lex_seconds;
+  int root = program();
+  double parsed = stats_clock();
 
-        clear_to_index(buffer, buffer_index);
-        buffer_index = 0;
-      }
-    }
-  }
+  if (hoist_invariants_enabled)
+    hoist_loop_invariants(root);
 
-  // print_both("\n");
-  // print_both("Token List:\n");
-  // print_tokens(token_list); // Print tokens to console and output file
-  // printf("\n");
+  if (common_subexprs_enabled)
+    eliminate_common_subexpressions(root);
+  double transformed = stats_clock();
 
   // First instruction is always JMP 0 3
-  code[0].op = 7;
-  code[0].l = 0;
-  code[0].m = 3;
-  cx++;
+  emit(7, 0, 3);
 
-  // Read in tokens in the tokens list and generate code
-  program();
+  // Generate code from the syntax tree
+  generate_program(root);
+  double generated = stats_clock();
 
-  print_instructions();
-  print_symbol_table();
+  if (peephole_enabled || remove_dead || dead_stores_enabled || constant_loads_enabled)
+    optimize_code();
 
-  destroy_list(token_list); // Free memory used by token list
-  fclose(input_file);       // Close input file
-  fclose(output_file);      // Close output file
-  return 0;
+  // The scanner runs while parsing, so its time comes out of the parser's. A sampled token stands in for more tokens
+  // than a short source has, so keep the estimate within the time parsing took
+  double lexing = lex_seconds - lexed;
+  lexing = lexing < 0 ? 0 : lexing > parsed - start ? parsed - start : lexing;
+  lex_seconds = lexed + lexing;
+  parse_seconds += parsed - start - lexing + generated - transformed;
+  optimize_seconds += transformed - parsed + stats_clock() - generated;
+  return root;
 }
 
-// Peek at the next character from the input file without consuming it
-char peekc()
+// Set up the state of a new compilation
+void create_compiler_state()
 {
-  int c = getc(input_file);
-  ungetc(c, input_file);
-  return (char)c;
+  token_list = create_list();
+  create_intern_table(&names);
+  create_symbol_table();
+  create_code_buffer();
+  cx = tx = level = 0;
+  ast_size = chain_size = 0;
+  program_vars = num_temporaries = 0;
 }
 
-// Print formatted output to both the console and the output file
-void print_both(const char *format, ...)
+// Empty the state of the last compilation for a new one, keeping the memory it grew for the next (see --serve)
+void reset_compiler_state()
 {
-  va_list args;
-  va_start(args, format);
-  vprintf(format, args);
-  va_end(args);
+  token_list->size = 0;
+  reset_intern_table(&names);
+  memset(scope_heads, -1, sizeof(int) * scope_capacity);
+  output_size = 0;
+  cx = tx = level = 0;
+  ast_size = chain_size = 0;
+  program_vars = num_temporaries = 0;
+}
 
-  va_start(args, format);
-  vfprintf(output_file, format, args);
-  va_end(args);
+// Free the memory used by a compilation
+void destroy_compiler_state()
+{
+  free(output_buffer);          // Free memory used by output buffer
+  destroy_list(token_list);     // Free memory used by token list
+  destroy_intern_table(&names); // Free memory used by interned names
+  destroy_symbol_table();       // Free memory used by symbol table
+  destroy_code_buffer();        // Free memory used by code array
+  free(ast);                    // Free memory used by syntax tree
+  free(chain);                  // Free memory used while generating code
+  output_buffer = NULL;
+  output_size = output_capacity = 0;
+  ast = NULL;
+  ast_capacity = 0;
+  chain = NULL;
+  chain_capacity = 0;
 }
 
-// Print the entire source code from the input file to both the console and the output file
-void print_source_code()
+// Compile one file for --batch with output only to the output file, returning 0 on success, the error code of a
+// syntax error, LEXER_ERROR if the scanner stopped, and 1 if the files couldn't be opened or read
+int compile_file(const char *input_path, const char *output_path)
 {
-  char c;
-  char lastChar = 0; // To keep track of the last character printed
-  while ((c = fgetc(input_file)) != EOF)
+  input_file = fopen(input_path, "r");
+  output_file = input_file != NULL ? fopen(output_path, "w") : NULL;
+  if (output_file == NULL || !load_source(input_file))
   {
-    print_both("%c", c);
-    lastChar = c;
+    fprintf(stderr, "Error: Could not compile %s to %s\n", input_path, output_path);
+    if (output_file != NULL)
+      fclose(output_file);
+    if (input_file != NULL)
+      fclose(input_file);
+    output_file = NULL;
+    return 1;
   }
-  if (lastChar != '\n') // If the last character wasn't a newline, print one
-    print_both("\n");
-  rewind(input_file); // Reset file pointer to the beginning of the file
-}
-
-// Clear a string up to a specified index by setting characters to null
-void clear_to_index(char *str, int index)
-{
-  for (int i = 0; i < index; i++)
-    str[i] = '\0';
-}
-
-// Check if given buffer matches any reserved word, return its corresponding token value
-int handle_reserved_word(char *buffer)
-{
-  if (strcmp(buffer, "const") == 0)
-    return constsym;
-  else if (strcmp(buffer, "var") == 0)
-    return varsym;
-  else if (strcmp(buffer, "begin") == 0)
-    return beginsym;
-  else if (strcmp(buffer, "end") == 0)
-    return endsym;
-  else if (strcmp(buffer, "if") == 0)
-    return ifsym;
-  else if (strcmp(buffer, "then") == 0)
-    return thensym;
-  else if (strcmp(buffer, "while") == 0)
-    return whilesym;
-  else if (strcmp(buffer, "do") == 0)
-    return dosym;
-  else if (strcmp(buffer, "read") == 0)
-    return readsym;
-  else if (strcmp(buffer, "write") == 0)
-    return writesym;
-  return 0; // invalid reserved word
-}
 
-// Check if given buffer matches any special symbol, return its corresponding token value
-int handle_special_symbol(char *buffer)
-{
-  if (strcmp(buffer, "+") == 0)
-    return plussym;
-  else if (strcmp(buffer, "-") == 0)
-    return minussym;
-  else if (strcmp(buffer, "*") == 0)
-    return multsym;
-  else if (strcmp(buffer, "/") == 0)
-    return slashsym;
-  else if (strcmp(buffer, "(") == 0)
-    return lparentsym;
-  else if (strcmp(buffer, ")") == 0)
-    return rparentsym;
-  else if (strcmp(buffer, ",") == 0)
-    return commasym;
-  else if (strcmp(buffer, ";") == 0)
-    return semicolonsym;
-  else if (strcmp(buffer, ".") == 0)
-    return periodsym;
-  else if (strcmp(buffer, "=") == 0)
-    return eqsym;
-  else if (strcmp(buffer, "<") == 0)
-    return lessym;
-  else if (strcmp(buffer, ">") == 0)
-    return gtrsym;
-  else if (strcmp(buffer, ":=") == 0)
-    return becomessym;
-  else if (strcmp(buffer, "<=") == 0)
-    return leqsym;
-  else if (strcmp(buffer, ">=") == 0)
-    return geqsym;
-  else if (strcmp(buffer, "<>") == 0)
-    return neqsym;
-  return 0; // invalid special symbol
-}
-
-// Check if a given character is a special symbol
-int is_special_symbol(char c)
-{
-  // If character matches, return 1 else return 0
-  return (c == '+' ||
-          c == '-' ||
-          c == '*' ||
-          c == '/' ||
-          c == '(' ||
-          c == ')' ||
-          c == '=' ||
-          c == ',' ||
-          c == '.' ||
-          c == '<' ||
-          c == '>' ||
-          c == ':' ||
-          c == ';' ||
-          c == '&' ||
-          c == '%' ||
-          c == '!' ||
-          c == '@' ||
-          c == '#' ||
-          c == '$' ||
-          c == '?' ||
-          c == '^' ||
-          c == '`' ||
-          c == '~' ||
-          c == '|');
-}
+  create_compiler_state();
+  jmp_buf jump;
+  error_jump = &jump;
+  int status = setjmp(jump);
+  if (status == 0)
+    compile_source(input_path);
+  error_jump = NULL;
 
-// Create and initialize new list for storing tokens
-list *create_list()
-{
-  list *l = malloc(sizeof(list));
-  l->size = 0;
-  l->capacity = 10;
-  l->tokens = malloc(sizeof(token) * l->capacity);
-  return l;
+  flush_output();
+  destroy_compiler_state();
+  unload_source();
+  fclose(input_file);
+  fclose(output_file);
+  output_file = NULL;
+  return status;
 }
 
-// Free the memory used by a list and its tokens
-list *destroy_list(list *l)
+// Library entry point, see parsercodegen.h. Compiles from the caller's buffer with the same thread-local state and
+// error recovery as compile_file, but writes nothing: the code and symbol table are copied into the result
+int pl0_compile(const char *text, size_t length, pl0_result *result)
 {
-  free(l->tokens);
-  free(l);
-  return NULL;
-}
+  memset(result, 0, sizeof(*result));
+  memset(&last_error, 0, sizeof(last_error));
+  source = (char *)text;
+  source_length = length;
+  output_file = NULL;
+  capture_output = 1;
+  create_compiler_state();
 
-// Append a token to a list, resizing the list if necessary
-list *append_token(list *l, token t)
-{
-  if (l->size == l->capacity)
+  jmp_buf jump;
+  error_jump = &jump;
+  int status = setjmp(jump);
+  if (status == 0)
   {
-    l->capacity *= 2;
-    l->tokens = realloc(l->tokens, sizeof(token) * l->capacity);
+    lexer lx;
+    open_source(&lx);
+    compile_program();
   }
-  l->tokens[l->size++] = t;
-  return l;
-}
+  error_jump = NULL;
+  capture_output = 0;
+  source = NULL;
 
-// Add a token to a list, resizing the list if necessary
-void add_token(list *l, token t)
-{
-  if (l->size == l->capacity)
+  if (status == 0)
   {
-    l->capacity *= 2;
-    l->tokens = realloc(l->tokens, sizeof(token) * l->capacity);
+    result->code = malloc(sizeof(pl0_instruction) * (cx > 0 ? cx : 1));
+    result->symbols = malloc(sizeof(pl0_symbol) * (tx > 0 ? tx : 1));
+    for (int i = 0; i < cx; i++)
+    {
+      result->code[i].op = code[i].op;
+      result->code[i].l = code[i].l;
+      result->code[i].m = code[i].m;
+    }
+    for (int i = 0; i < tx; i++)
+    {
+      pl0_symbol *entry = &result->symbols[i];
+      memset(entry, 0, sizeof(*entry));
+      entry->kind = symbol_table[i].kind;
+      strcpy(entry->name, symbol_table[i].name);
+      entry->val = symbol_table[i].val;
+      entry->level = symbol_table[i].level;
+      entry->addr = symbol_table[i].addr;
+      entry->mark = 1; // Every symbol is marked once compiling is done, as print_symbol_table does for the listing
+    }
+    result->num_instructions = cx;
+    result->num_symbols = tx;
   }
-  l->tokens[l->size++] = t;
+  result->error = last_error;
+  result->error.code = status;
+
+  destroy_compiler_state();
+  return status;
 }
 
-// Print the lexeme table to both the console and output file
-void print_lexeme_table(list *l)
+// Free the code and symbol table of a result filled by pl0_compile
+void pl0_free_result(pl0_result *result)
 {
-  for (int i = 0; i < l->size; i++)
-    print_both("%10s %20s\n", l->tokens[i].lexeme, l->tokens[i].value);
+  free(result->code);
+  free(result->symbols);
+  result->code = NULL;
+  result->symbols = NULL;
+  result->num_instructions = result->num_symbols = 0;
 }
 
-// Print the tokens to both the console and output file
-void print_tokens(list *l)
+// Write the text of a token into text, as it appears in the source ("" for the end of input)
+void describe_token(token t, char *text, size_t size)
 {
-  int counter; // Counter to keep track of the number of tokens printed for sake of ommitting extra new line character at end of file
+  if (t.type == identsym)
+    snprintf(text, size, "%s", interned_name(&names, t.value));
+  else if (t.type == numbersym)
+    snprintf(text, size, "%d", t.value);
+  else
+    snprintf(text, size, "%s", token_spelling[t.type]);
+}
 
-  for (int i = 0; i < l->size; i++)
+// Compile every pair of input and output files listed in a file, one pair per line, on worker threads, printing how
+// many succeeded and failed. Each worker starts with an even share of the files in its own deque and, once that's
+// empty, steals from the others, so a worker stuck on a large file doesn't hold up the rest. Returns 0 if every file
+// compiled
+int compile_batch(const char *list_path)
+{
+  FILE *list_file = fopen(list_path, "r");
+  if (list_file == NULL)
   {
-    print_both("%s ", l->tokens[i].value);
-    char identifier_value[3] = {0}, number_value[3] = {0};
-    sprintf(identifier_value, "%d", identsym);
-    sprintf(number_value, "%d", numbersym);
-
-    // Check if the token value matches identifier or number and print its lexeme
-    if (strcmp(l->tokens[i].value, identifier_value) == 0 || strcmp(l->tokens[i].value, number_value) == 0)
-      print_both("%s ", l->tokens[i].lexeme);
-    counter++;
+    fprintf(stderr, "Error: Could not open batch file %s\n", list_path);
+    return 1;
+  }
+  batch_info batch = {0};
+  int capacity = 0;
+  char input[4096], output[4096];
+  while (fscanf(list_file, "%4095s %4095s", input, output) == 2)
+  {
+    if (batch.num_files == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 64;
+      batch.inputs = realloc(batch.inputs, sizeof(char *) * capacity);
+      batch.outputs = realloc(batch.outputs, sizeof(char *) * capacity);
+    }
+    batch.inputs[batch.num_files] = strdup(input);
+    batch.outputs[batch.num_files] = strdup(output);
+    batch.num_files++;
   }
+  fclose(list_file);
 
-  // Print a newline if we haven't reached the last token
-  if (counter < l->size - 1)
+  batch.num_workers = num_jobs > 0 ? num_jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (batch.num_workers < 1)
+    batch.num_workers = 1;
+  if (batch.num_workers > batch.num_files && batch.num_files > 0)
+    batch.num_workers = batch.num_files;
+  batch.statuses = calloc(batch.num_files + 1, sizeof(int));
+  batch.rules = peephole_rules;
+  batch.workers = calloc(batch.num_workers, sizeof(batch_worker));
+  for (int w = 0; w < batch.num_workers; w++)
   {
-    print_both("\n");
+    batch_worker *worker = &batch.workers[w];
+    worker->batch = &batch;
+    worker->index = w;
+    worker->top = (long long)batch.num_files * w / batch.num_workers;
+    worker->bottom = (long long)batch.num_files * (w + 1) / batch.num_workers;
+    pthread_mutex_init(&worker->lock, NULL);
   }
-}
 
-// Parser/Codegen stuff
-token current_token; // Keep track of current token
+  double start = now_seconds();
+  for (int w = 1; w < batch.num_workers; w++)
+    pthread_create(&batch.workers[w].thread, NULL, batch_worker_main, &batch.workers[w]);
+  batch_worker_main(&batch.workers[0]); // The main thread is the first worker
+  for (int w = 1; w < batch.num_workers; w++)
+    pthread_join(batch.workers[w].thread, NULL);
+  double seconds = now_seconds() - start;
 
-// Get next token from token list
-void get_next_token()
-{
-  current_token = token_list->tokens[0];
-  for (int i = 0; i < token_list->size - 1; i++)
+  int failed = 0;
+  for (int i = 0; i < batch.num_files; i++)
+    failed += batch.statuses[i] != 0;
+  printf("Compiled %d files on %d threads: %d succeeded, %d failed\n", batch.num_files, batch.num_workers,
+         batch.num_files - failed, failed);
+  if (show_stats)
   {
-    token_list->tokens[i] = token_list->tokens[i + 1];
+    fprintf(stderr, "Statistics:\n");
+    fprintf(stderr, "  batch time: %.6f s\n", seconds);
+    if (seconds > 0)
+      fprintf(stderr, "  batch speed: %.0f files/s\n", batch.num_files / seconds);
+    if (cache_dir != NULL)
+      fprintf(stderr, "  cache: %d hits, %d misses\n", cache_hits, cache_misses);
+    for (int w = 0; w < batch.num_workers; w++)
+      fprintf(stderr, "  worker %d: compiled %d files, %d stolen\n", w, batch.workers[w].compiled,
+              batch.workers[w].stolen);
   }
-  token_list->size--;
+
+  for (int i = 0; i < batch.num_files; i++)
+  {
+    free(batch.inputs[i]);
+    free(batch.outputs[i]);
+  }
+  for (int w = 0; w < batch.num_workers; w++)
+    pthread_mutex_destroy(&batch.workers[w].lock);
+  free(batch.inputs);
+  free(batch.outputs);
+  free(batch.statuses);
+  free(batch.workers);
+  return failed > 0;
 }
 
-// Emit an instruction to the code array
-void emit(int op, int l, int m)
+// Run a --batch worker thread: compile files until every deque is empty
+void *batch_worker_main(void *arg)
 {
-  if (cx > MAX_INSTRUCTION_LENGTH)
+  batch_worker *worker = arg;
+  batch_info *batch = worker->batch;
+  if (batch->rules != peephole_rules) // Same rules as the main thread selected, which is worker 0 and has them already
+    memcpy(peephole_rules, batch->rules, sizeof(peephole_rules));
+  int job;
+  while ((job = take_job(batch, worker->index)) >= 0)
+  {
+    batch->statuses[job] = compile_file(batch->inputs[job], batch->outputs[job]);
+    worker->compiled++;
+  }
+  return NULL;
+}
+
+// Take the next file for a worker to compile from the bottom of its own deque, or steal one from the top of another
+// worker's, returning its index or -1 if every deque is empty. No files are added once the workers start, so a worker
+// that finds every deque empty is done
+int take_job(batch_info *batch, int index)
+{
+  batch_worker *own = &batch->workers[index];
+  int job = -1;
+  pthread_mutex_lock(&own->lock);
+  if (own->top < own->bottom)
+    job = --own->bottom;
+  pthread_mutex_unlock(&own->lock);
+
+  for (int k = 1; job < 0 && k < batch->num_workers; k++)
+  {
+    batch_worker *victim = &batch->workers[(index + k) % batch->num_workers];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->top < victim->bottom)
+      job = victim->top++;
+    pthread_mutex_unlock(&victim->lock);
+    if (job >= 0)
+      own->stolen++;
+  }
+  return job;
+}
+
+// Run --serve: answer requests on stdin and stdout, or on every connection to a Unix socket at path, each on its own
+// thread, until the input ends (or forever with a socket). Returns 0 unless a request was malformed or the socket
+// couldn't be set up
+int serve(const char *path)
+{
+  if (path == NULL)
+    return serve_stream(stdin, stdout);
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  struct stat info;
+  if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+    unlink(path); // Left behind by an earlier server
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || strlen(path) >= sizeof(address.sun_path) ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+  {
+    fprintf(stderr, "Error: Could not listen on socket %s\n", path);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN); // A client that goes away only ends its own connection
+
+  while (1)
+  {
+    int socket = accept(listener, NULL, NULL);
+    if (socket < 0)
+      continue;
+    server_connection *connection = malloc(sizeof(server_connection));
+    connection->socket = socket;
+    connection->rules = peephole_rules;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_connection, connection) == 0)
+      pthread_detach(thread);
+    else
+    {
+      close(socket);
+      free(connection);
+    }
+  }
+}
+
+// Answer the requests on one --serve socket connection, then close it
+void *serve_connection(void *arg)
+{
+  server_connection *connection = arg;
+  if (connection->rules != peephole_rules) // Same rules as the main thread selected, unless this is the main thread
+    memcpy(peephole_rules, connection->rules, sizeof(peephole_rules));
+  FILE *in = fdopen(connection->socket, "r");
+  FILE *out = fdopen(dup(connection->socket), "w");
+  if (in != NULL && out != NULL)
+    serve_stream(in, out);
+  if (in != NULL)
+    fclose(in);
+  else
+    close(connection->socket);
+  if (out != NULL)
+    fclose(out);
+  free(connection);
+  return NULL;
+}
+
+// Answer compile requests read from in on out until in ends, reusing one compiler state and request buffer for all of
+// them. A request is a line "listing LENGTH" or "binary LENGTH" followed by LENGTH chars of source. The response is a
+// line "STATUS LENGTH" followed by LENGTH bytes: the listing or the binary object, or whatever the listing shows when
+// the compilation stops. STATUS is 0, the error code, or LEXER_ERROR, as for compile_file. Returns 0 if in ended after
+// a whole request
+int serve_stream(FILE *in, FILE *out)
+{
+  char header[64], kind[16];
+  char *request = NULL;
+  size_t length, capacity = 0;
+  int status = 0;
+  create_compiler_state();
+  capture_output = 1;
+
+  while (fgets(header, sizeof(header), in) != NULL)
+  {
+    status = 1;
+    if (sscanf(header, "%15s %zu", kind, &length) != 2 || (strcmp(kind, "listing") != 0 && strcmp(kind, "binary") != 0))
+      break;
+    if (length >= capacity)
+    {
+      char *grown = realloc(request, length + 1);
+      if (grown == NULL)
+        break;
+      request = grown;
+      capacity = length + 1;
+    }
+    if (fread(request, 1, length, in) != length)
+      break;
+
+    int result = serve_request(request, length, kind[0] == 'b');
+    fprintf(out, "%d %zu\n", result, output_size);
+    fwrite(output_buffer, 1, output_size, out);
+    if (fflush(out) != 0)
+      break;
+    status = 0;
+  }
+
+  capture_output = 0;
+  source = NULL;
+  source_length = 0;
+  free(request);
+  destroy_compiler_state();
+  return status;
+}
+
+// Compile the source of a --serve request into the output buffer, as a listing or a binary object, returning the status
+int serve_request(char *text, size_t length, int binary)
+{
+  reset_compiler_state();
+  source = text;
+  source_length = length;
+  jmp_buf jump;
+  error_jump = &jump;
+  int status = setjmp(jump);
+  if (status == 0 && binary)
+  {
+    lexer lx;
+    open_source(&lx);
+    compile_program();
+    for (int i = 0; i < tx; i++)
+      symbol_table[i].mark = 1; // Marked as print_symbol_table leaves them, so the object matches --binary
+    append_object(!strip_symbols);
+  }
+  else if (status == 0)
+    compile_source("request");
+  error_jump = NULL;
+  return status;
+}
+
+// Set the option named by a command line argument, returning 0 if it isn't a known option
+int parse_option(const char *option)
+{
+  if (strcmp(option, "--lex-only") == 0)
+    lex_only = 1;
+  else if (strcmp(option, "--two-phase") == 0)
+    two_phase = 1;
+  else if (strncmp(option, "--max-code=", 11) == 0)
+    return parse_count(option + 11, &max_code);
+  else if (strncmp(option, "--max-symbols=", 14) == 0)
+    return parse_count(option + 14, &max_symbols);
+  else if (strcmp(option, "--quiet") == 0)
+    quiet = 1;
+  else if (strncmp(option, "--binary=", 9) == 0 && option[9] != '\0')
+    binary_path = option + 9;
+  else if (strncmp(option, "--emit-c=", 9) == 0 && option[9] != '\0')
+    c_path = option + 9;
+  else if (strcmp(option, "--strip-symbols") == 0)
+    strip_symbols = 1;
+  else if (strcmp(option, "--from-binary") == 0)
+    from_binary = 1;
+  else if (strcmp(option, "--run") == 0)
+    run_program = 1;
+  else if (strcmp(option, "--jit") == 0)
+    jit_enabled = 1;
+  else if (strncmp(option, "--batch=", 8) == 0 && option[8] != '\0')
+    batch_path = option + 8;
+  else if (strncmp(option, "--jobs=", 7) == 0)
+    return parse_count(option + 7, &num_jobs);
+  else if (strncmp(option, "--cache=", 8) == 0 && option[8] != '\0')
+    cache_dir = option + 8;
+  else if (strncmp(option, "--cache-size=", 13) == 0)
+    return parse_count(option + 13, &cache_megabytes);
+  else if (strcmp(option, "--serve") == 0)
+    serve_enabled = 1;
+  else if (strncmp(option, "--serve=", 8) == 0 && option[8] != '\0')
+  {
+    serve_enabled = 1;
+    serve_path = option + 8;
+  }
+  else if (strcmp(option, "--stats") == 0)
+    show_stats = 1;
+  else if (strcmp(option, "--stats=json") == 0)
+    show_stats = stats_json = 1;
+  else if (strcmp(option, "--optimize") == 0)
+    fold_constants = fuse_branches = hoist_invariants_enabled = common_subexprs_enabled = dead_stores_enabled =
+        constant_loads_enabled = remove_dead = peephole_enabled = select_peephole_rules(NULL);
+  else if (strcmp(option, "--fold-constants") == 0)
+    fold_constants = 1;
+  else if (strcmp(option, "--fuse-branches") == 0)
+    fuse_branches = 1;
+  else if (strcmp(option, "--hoist-invariants") == 0)
+    hoist_invariants_enabled = 1;
+  else if (strcmp(option, "--common-subexprs") == 0)
+    common_subexprs_enabled = 1;
+  else if (strcmp(option, "--dead-stores") == 0)
+    dead_stores_enabled = 1;
+  else if (strcmp(option, "--constant-loads") == 0)
+    constant_loads_enabled = 1;
+  else if (strcmp(option, "--remove-dead-code") == 0)
+    remove_dead = 1;
+  else if (strncmp(option, "--dump-cfg=", 11) == 0 && option[11] != '\0')
+    cfg_path = option + 11;
+  else if (strcmp(option, "--peephole") == 0)
+    peephole_enabled = select_peephole_rules(NULL);
+  else if (strncmp(option, "--peephole=", 11) == 0)
+    return peephole_enabled = select_peephole_rules(option + 11);
+  else
+    return 0;
+  return 1;
+}
+
+// Parse a non-negative decimal count from an option's value, returning 0 if it isn't one
+int parse_count(const char *text, int *count)
+{
+  long value = 0;
+  if (*text == '\0')
+    return 0;
+  for (; *text; text++)
+  {
+    if (!(char_class[(unsigned char)*text] & DIGIT_CHAR))
+      return 0;
+    value = value * 10 + (*text - '0');
+    if (value > 0x7fffffff)
+      return 0;
+  }
+  *count = (int)value;
+  return 1;
+}
+
+// Print formatted output to both the console and the output file, formatting it once into the output buffer
+void print_both(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(output_buffer + output_size, output_capacity - output_size, format, args);
+  va_end(args);
+
+  // Format again if the text didn't fit in the space left
+  if (output_size + length >= output_capacity)
+  {
+    reserve_output(length + 1);
+    va_start(args, format);
+    vsnprintf(output_buffer + output_size, output_capacity - output_size, format, args);
+    va_end(args);
+  }
+  output_size += length;
+
+  if (output_size >= OUTPUT_FLUSH_SIZE)
+    flush_output();
+}
+
+// Make room for at least length more chars in the output buffer
+void reserve_output(size_t length)
+{
+  if (output_size + length <= output_capacity)
+    return;
+  if (output_capacity == 0)
+    output_capacity = 4096;
+  while (output_size + length > output_capacity)
+    output_capacity *= 2;
+  output_buffer = realloc(output_buffer, output_capacity);
+}
+
+// Append text to the output buffer
+void append_output(const char *text, size_t length)
+{
+  reserve_output(length);
+  memcpy(output_buffer + output_size, text, length);
+  output_size += length;
+}
+
+// Append an integer right aligned in a field of the given width (same as printf's "%<width>d")
+void append_padded_int(int value, int width)
+{
+  char digits[12];
+  int count = 0;
+  unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+  // Write digits from least to most significant
+  do
+  {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+  if (value < 0)
+    digits[count++] = '-';
+
+  int padding = width > count ? width - count : 0;
+  reserve_output(padding + count);
+  memset(output_buffer + output_size, ' ', padding);
+  output_size += padding;
+  while (count > 0)
+    output_buffer[output_size++] = digits[--count];
+}
+
+// Append a string right aligned in a field of the given width (same as printf's "%<width>s")
+void append_padded_string(const char *text, int width)
+{
+  int length = strlen(text);
+  int padding = width > length ? width - length : 0;
+  reserve_output(padding + length);
+  memset(output_buffer + output_size, ' ', padding);
+  output_size += padding;
+  memcpy(output_buffer + output_size, text, length);
+  output_size += length;
+}
+
+// Write the output buffer to the console and the output file with one write each
+void flush_output()
+{
+  if (output_size == 0 || capture_output)
+    return;
+  if (!quiet)
+  {
+    fwrite(output_buffer, 1, output_size, stdout);
+    fflush(stdout);
+  }
+  if (output_file != NULL) // Output file may not have been opened yet
+  {
+    fwrite(output_buffer, 1, output_size, output_file);
+    fflush(output_file);
+    bytes_written += output_size;
+  }
+  output_size = 0;
+}
+
+// Print the entire source code from the source buffer to both the console and the output file
+void print_source_code()
+{
+  print_both("%.*s", (int)source_length, source);
+  if (source_length == 0 || source[source_length - 1] != '\n') // If the last character wasn't a newline, print one
+    print_both("\n");
+}
+
+// Map the whole input file into memory (or read it in one shot if it can't be mapped), returning 1 on success
+int load_source(FILE *file)
+{
+  struct stat info;
+  int fd = fileno(file);
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+  {
+    void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED)
+    {
+      source = mapped;
+      source_length = info.st_size;
+      source_mapped = 1;
+      return 1;
+    }
+  }
+
+  // Fall back to reading the file into a growing buffer
+  size_t capacity = 4096;
+  source = malloc(capacity);
+  source_length = 0;
+  source_mapped = 0;
+  while (1)
+  {
+    if (source_length == capacity)
+    {
+      capacity *= 2;
+      source = realloc(source, capacity);
+    }
+    size_t count = fread(source + source_length, 1, capacity - source_length, file);
+    if (count == 0)
+      break;
+    source_length += count;
+  }
+  return !ferror(file);
+}
+
+// Release the source buffer
+void unload_source()
+{
+  if (source_mapped)
+    munmap(source, source_length);
+  else
+    free(source);
+}
+
+// Point a lexer at the start of a source buffer
+void open_lexer(lexer *lx, const char *text, size_t length)
+{
+  lx->cur = text;
+  lx->end = text + length;
+}
+
+// Scan the next token from the lexer's buffer, returning 0 once the end of the source is reached
+int scan_token(lexer *lx, token *t)
+{
+  const char *p = lx->cur;
+  const char *end = lx->end;
+
+  while (p < end)
+  {
+    char c = *p;
+    int kind = char_class[(unsigned char)c];
+    if (kind & DIGIT_CHAR) // Handle numbers
+    {
+      const char *start = p;
+      int value = 0;
+      for (; p < end && (char_class[(unsigned char)*p] & DIGIT_CHAR); p++)
+      {
+        if (p - start < MAX_NUMBER_LENGTH) // Digits past the limit would overflow value, the number is rejected anyway
+          value = value * 10 + (*p - '0');
+      }
+      if (p - start > MAX_NUMBER_LENGTH) // Number is too long
+        lexer_error(start, p - start, "number too long");
+      *t = make_token(numbersym, value);
+      lx->cur = p;
+      return 1;
+    }
+    else if (kind & ALPHA_CHAR) // Handle identifiers and reserved words
+    {
+      const char *start = p;
+      while (p < end && (char_class[(unsigned char)*p] & (ALPHA_CHAR | DIGIT_CHAR)))
+        p++;
+      int length = p - start;
+      if (length > MAX_IDENTIFIER_LENGTH) // Identifier is too long (reserved words are shorter than this)
+        lexer_error(start, length, "identifier too long");
+
+      int token_value = handle_reserved_word(start, length); // Check reserved words
+      if (token_value)
+        *t = make_token(token_value, 0);
+      else
+        *t = make_token(identsym, intern_name(&names, start, length));
+      lx->cur = p;
+      return 1;
+    }
+    else if (kind & SPECIAL_CHAR) // Handle special symbols
+    {
+      char nextc = p + 1 < end ? p[1] : '\0';
+
+      // Handle block comments, consuming characters until we reach the end of the block comment
+      if (c == '/' && nextc == '*')
+      {
+        p += 1; // The closing search starts at the opening '*', so "/*/" is a complete comment
+        while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+          p++;
+        p += 2;
+        continue;
+      }
+
+      // Handle single line comments, consuming characters until we reach the end of the line
+      if (c == '/' && nextc == '/')
+      {
+        while (p < end && *p != '\n')
+          p++;
+        p++;
+        continue;
+      }
+
+      // Prefer a two character symbol when the pair makes one, otherwise take the first character alone
+      int length;
+      int token_value = handle_special_symbol(c, nextc, &length);
+      if (!token_value) // Invalid symbol
+        lexer_error(p, 1, "invalid symbol");
+      p += length;
+      *t = make_token(token_value, 0);
+      lx->cur = p < end ? p : end;
+      return 1;
+    }
+    else // Skip whitespace, control characters and anything else that can't start a token
+    {
+      p++;
+    }
+  }
+
+  lx->cur = end;
+  return 0;
+}
+
+// Stop compiling at text the scanner can't make a token of. Nothing is printed, but the text and the reason are kept
+// for pl0_compile
+void lexer_error(const char *text, int length, const char *message)
+{
+  snprintf(last_error.lexeme, sizeof(last_error.lexeme), "%.*s", length, text);
+  snprintf(last_error.message, sizeof(last_error.message), "%s", message);
+  stop_compiling(LEXER_ERROR);
+}
+
+// Check if a word of the given length is a reserved word, return its corresponding token value
+int handle_reserved_word(const char *word, int length)
+{
+  // Dispatch on length and first character so at most one comparison is made
+  switch (length)
+  {
+  case 2:
+    if (word[0] == 'i' && word[1] == 'f')
+      return ifsym;
+    if (word[0] == 'd' && word[1] == 'o')
+      return dosym;
+    break;
+  case 3:
+    if (word[0] == 'v' && memcmp(word, "var", 3) == 0)
+      return varsym;
+    if (word[0] == 'e' && memcmp(word, "end", 3) == 0)
+      return endsym;
+    if (word[0] == 'o' && memcmp(word, "odd", 3) == 0)
+      return oddsym;
+    break;
+  case 4:
+    if (word[0] == 't' && memcmp(word, "then", 4) == 0)
+      return thensym;
+    if (word[0] == 'r' && memcmp(word, "read", 4) == 0)
+      return readsym;
+    break;
+  case 5:
+    switch (word[0])
+    {
+    case 'c':
+      return memcmp(word, "const", 5) == 0 ? constsym : 0;
+    case 'b':
+      return memcmp(word, "begin", 5) == 0 ? beginsym : 0;
+    case 'w':
+      if (memcmp(word, "while", 5) == 0)
+        return whilesym;
+      return memcmp(word, "write", 5) == 0 ? writesym : 0;
+    }
+    break;
+  }
+  return 0; // invalid reserved word
+}
+
+// Check if a special character (and the one after it) make a special symbol, return its corresponding token value
+// and store the number of characters it uses in length
+int handle_special_symbol(char c, char nextc, int *length)
+{
+  // Two character symbols take priority over their first character alone
+  *length = 2;
+  switch (c)
+  {
+  case ':':
+    if (nextc == '=')
+      return becomessym;
+    break;
+  case '<':
+    if (nextc == '=')
+      return leqsym;
+    if (nextc == '>')
+      return neqsym;
+    break;
+  case '>':
+    if (nextc == '=')
+      return geqsym;
+    break;
+  }
+
+  *length = 1;
+  return single_symbols[(unsigned char)c]; // 0 if invalid special symbol
+}
+
+// Create and initialize new list for storing tokens
+list *create_list()
+{
+  list *l = malloc(sizeof(list));
+  l->size = 0;
+  l->capacity = 10;
+  l->tokens = malloc(sizeof(token) * l->capacity);
+  return l;
+}
+
+// Free the memory used by a list and its tokens
+list *destroy_list(list *l)
+{
+  free(l->tokens);
+  free(l);
+  return NULL;
+}
+
+// Append a token to a list, resizing the list if necessary
+list *append_token(list *l, token t)
+{
+  if (l->size == l->capacity)
+  {
+    l->capacity *= 2;
+    l->tokens = realloc(l->tokens, sizeof(token) * l->capacity);
+  }
+  l->tokens[l->size++] = t;
+  return l;
+}
+
+// Add a token to a list, resizing the list if necessary
+void add_token(list *l, token t)
+{
+  if (l->size == l->capacity)
+  {
+    l->capacity *= 2;
+    l->tokens = realloc(l->tokens, sizeof(token) * l->capacity);
+  }
+  l->tokens[l->size++] = t;
+}
+
+// Create a token of the given type carrying a decoded value
+token make_token(token_type type, int value)
+{
+  token t;
+  t.type = type;
+  t.value = value;
+  return t;
+}
+
+// Create and initialize an empty intern table
+void create_intern_table(intern_table *table)
+{
+  table->chars_size = 0;
+  table->chars_capacity = 256;
+  table->chars = malloc(table->chars_capacity);
+  table->count = 0;
+  table->capacity = 16;
+  table->offsets = malloc(sizeof(int) * table->capacity);
+  table->slot_capacity = 32;
+  table->slots = malloc(sizeof(int) * table->slot_capacity);
+  memset(table->slots, -1, sizeof(int) * table->slot_capacity);
+}
+
+// Free the memory used by an intern table
+void destroy_intern_table(intern_table *table)
+{
+  free(table->chars);
+  free(table->offsets);
+  free(table->slots);
+}
+
+// Remove every name from an intern table, keeping its memory
+void reset_intern_table(intern_table *table)
+{
+  table->chars_size = 0;
+  table->count = 0;
+  memset(table->slots, -1, sizeof(int) * table->slot_capacity);
+}
+
+// FNV-1a hash of a name
+unsigned int hash_name(const char *name, int length)
+{
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Return the id of a name, adding it to the intern table if it hasn't been seen before
+int intern_name(intern_table *table, const char *name, int length)
+{
+  unsigned int mask = table->slot_capacity - 1;
+  unsigned int slot = hash_name(name, length) & mask;
+
+  // Probe until we find the name or an empty slot
+  while (table->slots[slot] != -1)
+  {
+    const char *existing = table->chars + table->offsets[table->slots[slot]];
+    names_compared++;
+    if (strncmp(existing, name, length) == 0 && existing[length] == '\0')
+      return table->slots[slot];
+    slot = (slot + 1) & mask;
+  }
+
+  // Copy the name's text into the table
+  while (table->chars_size + length + 1 > table->chars_capacity)
+  {
+    table->chars_capacity *= 2;
+    table->chars = realloc(table->chars, table->chars_capacity);
+  }
+  memcpy(table->chars + table->chars_size, name, length);
+  table->chars[table->chars_size + length] = '\0';
+
+  if (table->count == table->capacity)
+  {
+    table->capacity *= 2;
+    table->offsets = realloc(table->offsets, sizeof(int) * table->capacity);
+  }
+  int id = table->count++;
+  table->offsets[id] = table->chars_size;
+  table->chars_size += length + 1;
+  table->slots[slot] = id;
+
+  // Keep the hash table at most half full so probes stay short
+  if (table->count * 2 > table->slot_capacity)
+  {
+    free(table->slots);
+    table->slot_capacity *= 2;
+    table->slots = malloc(sizeof(int) * table->slot_capacity);
+    memset(table->slots, -1, sizeof(int) * table->slot_capacity);
+    mask = table->slot_capacity - 1;
+    for (int i = 0; i < table->count; i++)
+    {
+      const char *text = table->chars + table->offsets[i];
+      slot = hash_name(text, strlen(text)) & mask;
+      while (table->slots[slot] != -1)
+        slot = (slot + 1) & mask;
+      table->slots[slot] = i;
+    }
+  }
+  return id;
+}
+
+// Get the text of an interned name from its id
+const char *interned_name(intern_table *table, int id)
+{
+  return table->chars + table->offsets[id];
+}
+
+// Print the lexeme table to both the console and output file
+void print_lexeme_table(list *l)
+{
+  for (int i = 0; i < l->size; i++)
+  {
+    if (l->tokens[i].type == identsym)
+      print_both("%10s %20d\n", interned_name(&names, l->tokens[i].value), identsym);
+    else if (l->tokens[i].type == numbersym)
+      print_both("%10d %20d\n", l->tokens[i].value, numbersym);
+    else
+      print_both("%10s %20d\n", token_spelling[l->tokens[i].type], l->tokens[i].type);
+  }
+}
+
+// Print the tokens to both the console and output file
+void print_tokens(list *l)
+{
+  int counter = 0; // Counter to keep track of the number of tokens printed for sake of ommitting extra new line character at end of file
+
+  for (int i = 0; i < l->size; i++)
+  {
+    print_both("%d ", l->tokens[i].type);
+
+    // Check if the token is an identifier or number and print its lexeme
+    if (l->tokens[i].type == identsym)
+      print_both("%s ", interned_name(&names, l->tokens[i].value));
+    else if (l->tokens[i].type == numbersym)
+      print_both("%d ", l->tokens[i].value);
+    counter++;
+  }
+
+  // Print a newline if we haven't reached the last token
+  if (counter < l->size - 1)
+  {
+    print_both("\n");
+  }
+}
+
+// Parser/Codegen stuff
+
+// Point a token stream at the start of a token list
+void open_stream(token_stream *s, list *source)
+{
+  s->source = source;
+  s->pos = 0;
+  s->lx = NULL;
+  s->num_ahead = 0;
+}
+
+// Point a token stream at a lexer so tokens are scanned only when the parser asks for them
+void open_lexer_stream(token_stream *s, lexer *lx)
+{
+  s->source = NULL;
+  s->pos = 0;
+  s->lx = lx;
+  s->num_ahead = 0;
+}
+
+// Look at a token ahead of the cursor without consuming it (offset 0 is the next token, offset < MAX_LOOKAHEAD)
+token *peek_token(token_stream *s, int offset)
+{
+  if (s->source != NULL)
+  {
+    if (s->pos + offset >= s->source->size)
+      return &end_of_input;
+    return &s->source->tokens[s->pos + offset];
+  }
+
+  // Pull tokens from the lexer until the requested one has been scanned
+  while (s->num_ahead <= offset)
+  {
+    if (!pull_token(s->lx, &s->ahead[s->num_ahead]))
+      return &end_of_input;
+    s->num_ahead++;
+  }
+  return &s->ahead[offset];
+}
+
+// Scan the next token for the parser, counting it for --stats. Reading the clock takes longer than scanning a token,
+// so only one token in LEX_SAMPLE_RATE is timed, less the clock's own overhead, and stands in for the others
+int pull_token(lexer *lx, token *t)
+{
+  if (!show_stats)
+    return scan_token(lx, t);
+  double start = tokens_pulled++ % LEX_SAMPLE_RATE == 0 ? now_seconds() : 0;
+  int scanned = scan_token(lx, t);
+  if (start != 0)
+    lex_seconds += (now_seconds() - start - clock_overhead) * LEX_SAMPLE_RATE;
+  tokens_scanned += scanned;
+  return scanned;
+}
+
+// Get next token from the token stream by advancing its cursor
+void get_next_token()
+{
+  if (stream.source != NULL)
+  {
+    current_token = *peek_token(&stream, 0);
+    if (stream.pos < stream.source->size)
+      stream.pos++;
+  }
+  else if (stream.num_ahead > 0)
+  {
+    // Hand out the oldest token that was peeked at
+    current_token = stream.ahead[0];
+    stream.num_ahead--;
+    memmove(stream.ahead, stream.ahead + 1, sizeof(token) * stream.num_ahead);
+  }
+  else if (!pull_token(stream.lx, &current_token))
+  {
+    current_token = end_of_input;
+  }
+}
+
+// Create an empty code array
+void create_code_buffer()
+{
+  code_capacity = 64;
+  code = malloc(sizeof(instruction) * code_capacity);
+}
+
+// Free the memory used by the code array
+void destroy_code_buffer()
+{
+  free(code);
+}
+
+// Grow the code array until it can hold at least count instructions
+void reserve_code(int count)
+{
+  while (code_capacity < count)
+    code_capacity *= 2;
+  code = realloc(code, sizeof(instruction) * code_capacity);
+}
+
+// Emit an instruction to the code array, growing it if necessary
+void emit(int op, int l, int m)
+{
+  if (max_code > 0 && cx >= max_code)
   {
     error(16);
   }
   else
   {
-    code[cx].op = op;
-    code[cx].l = l;
-    code[cx].m = m;
-    cx++;
+    if (cx == code_capacity)
+      reserve_code(cx + 1);
+    code[cx].op = op;
+    code[cx].l = l;
+    code[cx].m = m;
+    cx++;
+    instructions_generated++;
+  }
+}
+
+// Print an error message and stop compiling
+void error(int error_code)
+{
+  describe_token(current_token, last_error.lexeme, sizeof(last_error.lexeme));
+  size_t start = output_size;
+  print_both("Error: ");
+  switch (error_code)
+  {
+  case 1:
+    print_both("program must end with a period\n");
+    break;
+  case 2:
+    print_both("const, var, and read keywords must be followed by identifier\n");
+    break;
+  case 3:
+    print_both("symbol name has already been declared\n");
+    break;
+  case 4:
+    print_both("constants must be assigned with =\n");
+    break;
+  case 5:
+    print_both("constants must be assigned an integer value\n");
+    break;
+  case 6:
+    print_both("constant and variables declarations must be followed by a semicolon\n");
+    break;
+  case 7:
+    print_both("undeclared identifier %s\n", interned_name(&names, current_token.value));
+    break;
+  case 8:
+    print_both("only variable values may be altered\n");
+    break;
+  case 9:
+    print_both("assignment statements must use :=\n");
+    break;
+  case 10:
+    print_both("begin must be followed by end\n");
+    break;
+  case 11:
+    print_both("if must be followed by then\n");
+    break;
+  case 12:
+    print_both("while must be followed by do\n");
+    break;
+  case 13:
+    print_both("condition must contain comparison operator\n");
+    break;
+  case 14:
+    print_both("right parenthesis must follow left parenthesis\n");
+    break;
+  case 15:
+    print_both("arithmetic equations must contain operands, parenthesis, numbers, or symbols\n");
+    break;
+  case 16:
+    print_both("program too long\n");
+    break;
+  case 17:
+    print_both("too many symbols\n");
+  }
+
+  // Keep the message for pl0_compile, without "Error: " and the newline
+  if (output_size > start + 8)
+    snprintf(last_error.message, sizeof(last_error.message), "%.*s", (int)(output_size - start - 8),
+             output_buffer + start + 7);
+  stop_compiling(error_code);
+}
+
+// Stop the compilation after an error, returning status to compile_file when it's running the compilation and
+// exiting otherwise
+void stop_compiling(int status)
+{
+  flush_output();
+  if (error_jump != NULL)
+    longjmp(*error_jump, status);
+  exit(1);
+}
+
+// Create an empty symbol table
+void create_symbol_table()
+{
+  symbol_capacity = MAX_SYMBOL_TABLE_SIZE;
+  symbol_table = malloc(sizeof(symbol) * symbol_capacity);
+  scope_capacity = 64;
+  scope_heads = malloc(sizeof(int) * scope_capacity);
+  memset(scope_heads, -1, sizeof(int) * scope_capacity);
+}
+
+// Free the memory used by the symbol table
+void destroy_symbol_table()
+{
+  free(symbol_table);
+  free(scope_heads);
+}
+
+// Find the symbol visible for an interned name at the current level, returning its index or -1
+int check_symbol_table(int name_id)
+{
+  symbol_lookups++;
+  if (name_id >= scope_capacity)
+    return -1;
+
+  // Walk from the newest declaration of the name to the oldest
+  for (int i = scope_heads[name_id]; i != -1; i = symbol_table[i].shadowed)
+  {
+    symbols_compared++;
+    if (!symbol_table[i].mark && symbol_table[i].level <= level)
+      return i;
+  }
+  return -1;
+}
+
+// Add a symbol to the symbol table, growing it if necessary
+void add_symbol(int kind, int name_id, int val, int level, int addr, int mark)
+{
+  if (max_symbols > 0 && tx >= max_symbols)
+  {
+    error(17);
+  }
+  if (tx == symbol_capacity)
+  {
+    symbol_capacity *= 2;
+    symbol_table = realloc(symbol_table, sizeof(symbol) * symbol_capacity);
+  }
+  if (name_id >= scope_capacity)
+  {
+    int old_capacity = scope_capacity;
+    while (name_id >= scope_capacity)
+      scope_capacity *= 2;
+    scope_heads = realloc(scope_heads, sizeof(int) * scope_capacity);
+    memset(scope_heads + old_capacity, -1, sizeof(int) * (scope_capacity - old_capacity));
+  }
+
+  symbol_table[tx].kind = kind;
+  strcpy(symbol_table[tx].name, interned_name(&names, name_id));
+  symbol_table[tx].val = val;
+  symbol_table[tx].level = level;
+  symbol_table[tx].addr = addr;
+  symbol_table[tx].mark = mark;
+  symbol_table[tx].name_id = name_id;
+  symbol_table[tx].shadowed = scope_heads[name_id];
+  scope_heads[name_id] = tx;
+  tx++;
+}
+
+// Parse the program, returning its syntax tree
+int program()
+{
+  get_next_token();                    // Get first token
+  int root = block();                  // Parse block
+  if (current_token.type != periodsym) // Check if program ends with a period
+  {
+    error(1); // Error if it doesn't
+  }
+  return root;
+}
+
+int block()
+{
+  const_declaration();              // Parse constants
+  int num_vars = var_declaration(); // Parse variables
+  int body = statement();           // Parse statement
+  return new_node(ast_block, 0, num_vars, body);
+}
+
+// Parse constants
+void const_declaration()
+{
+  int name_id; // Track name of constant
+  // Check if current token is a const
+  if (current_token.type == constsym)
+  {
+    do
+    {
+      get_next_token();
+      if (current_token.type != identsym) // Check if next token is an identifier
+      {
+        error(2); // Error if it isn't
+      }
+      name_id = current_token.value;                    // Save name of constant
+      int sx = check_symbol_table(current_token.value); // Check if constant has already been declared
+      if (sx != -1 && symbol_table[sx].level == level)
+      {
+        error(3); // Error if it has
+      }
+      get_next_token();
+      if (current_token.type != eqsym) // Check if next token is an equals sign
+      {
+        error(4); // Error if it isn't
+      }
+      get_next_token();
+      if (current_token.type != numbersym) // Check if next token is a number
+      {
+        error(5); // Error if it isn't
+      }
+      add_symbol(1, name_id, current_token.value, level, 0, 0); // Add constant to symbol table
+      get_next_token();
+    } while (current_token.type == commasym); // Continue parsing constants if next token is a comma
+    if (current_token.type != semicolonsym)   // Check if next token is a semicolon
+    {
+      error(6); // Error if it isn't
+    }
+    get_next_token();
+  }
+}
+
+// Parse variables
+int var_declaration()
+{
+  int num_vars = 0;                 // Track number of variables
+  if (current_token.type == varsym) // Check if current token is a var
+  {
+    do
+    {
+      num_vars++; // Increment number of variables
+      get_next_token();
+      if (current_token.type != identsym) // Check if next token is an identifier
+      {
+        error(2);
+      }
+      int sx = check_symbol_table(current_token.value); // Check if variable has already been declared
+      if (sx != -1 && symbol_table[sx].level == level)
+      {
+        error(3); // Error if it has
+      }
+      add_symbol(2, current_token.value, 0, 0, num_vars + 2, 0); // Add variable to symbol table
+      get_next_token();
+    } while (current_token.type == commasym); // Continue parsing variables if next token is a comma
+    if (current_token.type != semicolonsym)   // Check if next token is a semicolon
+    {
+      error(6); // Error if it isn't
+    }
+    get_next_token();
+  }
+  return num_vars; // Return number of variables
+}
+
+// Parse statements, returning the statement's node (-1 for an empty statement)
+int statement()
+{
+  if (current_token.type == identsym) // Check if current token is an identifier
+  {
+    int sx = check_symbol_table(current_token.value); // Check if identifier is in symbol table
+    if (sx == -1)
+    {
+      error(7); // Error if it isn't
+    }
+    if (symbol_table[sx].kind != 2) // Check if identifier is a variable
+    {
+      error(8); // Error if it isn't
+    }
+    get_next_token();
+    if (current_token.type != becomessym) // Check if next token is a becomes symbol (:=)
+    {
+      error(9); // Error if it isn't
+    }
+    get_next_token();
+    int value = expression(); // Parse expression
+    return new_node(ast_assign, 0, sx, value);
+  }
+  else if (current_token.type == beginsym) // Check if current token is a begin
+  {
+    int node = new_node(ast_begin, 0, -1, -1);
+    int last = -1; // Last statement in the block so far
+    do
+    {
+      get_next_token();
+      int child = statement(); // Parse statement
+      if (child == -1)
+        continue;
+      if (last == -1)
+        ast[node].a = child;
+      else
+        ast[last].next = child;
+      last = child;
+    } while (current_token.type == semicolonsym); // Continue parsing statements if next token is a semicolon
+    if (current_token.type != endsym)             // Check if next token is an end
+    {
+      error(10); // Error if it isn't
+    }
+    get_next_token();
+    return node;
+  }
+  else if (current_token.type == ifsym) // Check if current token is an if
+  {
+    get_next_token();
+    int test = condition();            // Parse condition
+    if (current_token.type != thensym) // Check if next token is a then
+    {
+      error(11); // Error if it isn't
+    }
+    get_next_token();
+    int body = statement(); // Parse statement
+    return new_node(ast_if, 0, test, body);
+  }
+  else if (current_token.type == whilesym) // Check if current token is a while
+  {
+    get_next_token();
+    int test = condition();          // Parse condition
+    if (current_token.type != dosym) // Check if next token is a do
+    {
+      error(12); // Error if it isn't
+    }
+    get_next_token();
+    int body = statement(); // Parse statement
+    return new_node(ast_while, 0, test, body);
+  }
+  else if (current_token.type == readsym) // Check if current token is a read
+  {
+    get_next_token();
+    if (current_token.type != identsym) // Check if current token is an identifier
+    {
+      error(2); // Error if it isn't
+    }
+    int sx = check_symbol_table(current_token.value); // Check if identifier is in symbol table
+    if (sx == -1)
+    {
+      error(7); // Error if it isn't
+    }
+    if (symbol_table[sx].kind != 2) // Check if identifier is a variable
+    {
+      error(8); // Error if it isn't
+    }
+    get_next_token();
+    return new_node(ast_read, 0, sx, -1);
+  }
+  else if (current_token.type == writesym) // Check if current token is a write
+  {
+    get_next_token();
+    int value = expression(); // Parse expression
+    return new_node(ast_write, 0, value, -1);
+  }
+  return -1;
+}
+
+// Parse condition, returning its node
+int condition()
+{
+  if (current_token.type == oddsym) // Check if current token is odd
+  {
+    get_next_token();
+    int operand = expression(); // Parse expression
+    return new_node(ast_odd, 11, operand, -1);
+  }
+
+  int left = expression();    // Parse expression
+  int m;                      // OPR M of the comparison
+  switch (current_token.type) // Check if current token is a comparison operator
+  {
+  case eqsym:
+    m = 5; // EQL
+    break;
+  case neqsym:
+    m = 6; // NEQ
+    break;
+  case lessym:
+    m = 7; // LSS
+    break;
+  case leqsym:
+    m = 8; // LEQ
+    break;
+  case gtrsym:
+    m = 9; // GTR
+    break;
+  case geqsym:
+    m = 10; // GEQ
+    break;
+  default:
+    error(13); // Error if it isn't
+  }
+  get_next_token();
+  int right = expression(); // Parse expression
+  return new_node(ast_operation, m, left, right);
+}
+
+// Parse expression, returning its node
+int expression()
+{
+  int node = term(); // Parse term
+  // Check if current token is a plus or minus
+  while (current_token.type == plussym || current_token.type == minussym)
+  {
+    int m = current_token.type == plussym ? 1 : 2; // ADD or SUB
+    get_next_token();
+    int right = term(); // Parse term
+    node = new_node(ast_operation, m, node, right);
+  }
+  return node;
+}
+
+// Parse term, returning its node
+int term()
+{
+  int node = factor(); // Parse factor
+  while (current_token.type == multsym || current_token.type == slashsym)
+  {
+    int m = current_token.type == multsym ? 3 : 4; // MUL or DIV
+    get_next_token();
+    int right = factor(); // Parse factor
+    node = new_node(ast_operation, m, node, right);
+  }
+  return node;
+}
+
+// Parse factor, returning its node
+int factor()
+{
+  int node = -1;
+  if (current_token.type == identsym) // Check if current token is an identifier
+  {
+    int sx = check_symbol_table(current_token.value); // Check if identifier is in symbol table
+    if (sx == -1)
+    {
+      error(7); // Error if it isn't
+    }
+    if (symbol_table[sx].kind == 1) // Check if identifier is a constant
+    {
+      node = new_node(ast_number, 0, symbol_table[sx].val, -1);
+    }
+    else
+    {
+      node = new_node(ast_variable, 0, sx, -1);
+    }
+    get_next_token();
+  }
+  else if (current_token.type == numbersym) // Check if current token is a number
+  {
+    node = new_node(ast_number, 0, current_token.value, -1);
+    get_next_token();
+  }
+  else if (current_token.type == lparentsym) // Check if current token is a left parenthesis
+  {
+    get_next_token();
+    node = expression();                  // Parse expression
+    if (current_token.type != rparentsym) // Check if currenet token is right parenthesis
+    {
+      error(14); // Error if it isn't
+    }
+    get_next_token();
+  }
+  else
+  {
+    error(15); // Error if current token is none of the above
+  }
+  return node;
+}
+
+// Add a node to the syntax tree, returning its index
+int new_node(int kind, int op, int a, int b)
+{
+  if (ast_size == ast_capacity)
+  {
+    ast_capacity = ast_capacity ? ast_capacity * 2 : 1024;
+    ast = realloc(ast, sizeof(ast_node) * ast_capacity);
+  }
+  ast[ast_size] = (ast_node){kind, op, a, b, -1};
+  return ast_size++;
+}
+
+// Move the computations inside every while loop that give the same value on each iteration out in front of the loop,
+// saving each one in a temporary the loop then loads instead
+void hoist_loop_invariants(int root)
+{
+  program_vars = ast[root].a;
+  hoist_statement(ast[root].b);
+}
+
+// Hoist loop invariants out of the loops in a statement and, for a statement in a begin block, the statements after it.
+// Inner loops go first, so something they hoisted can be hoisted again out of the loop around them
+void hoist_statement(int node)
+{
+  for (; node != -1; node = ast[node].next)
+  {
+    if (ast[node].kind == ast_begin)
+      hoist_statement(ast[node].a);
+    else if (ast[node].kind == ast_if)
+      hoist_statement(ast[node].b);
+    else if (ast[node].kind == ast_while)
+    {
+      hoist_statement(ast[node].b);
+      hoist_loop(node);
+    }
+  }
+}
+
+// Hoist the invariants out of one while loop. The loop's node becomes a begin block that saves each invariant in its
+// temporary and then runs the loop
+void hoist_loop(int node)
+{
+  loop_info loop = {0};
+  loop.stored = calloc(3 + program_vars + num_temporaries, 1);
+  mark_stores(ast[node].b, &loop);
+
+  // The condition is computed at least once whenever the loop is reached, so anything in it can be computed before
+  // the loop. The body may not run at all, so only what can't fail at run time is taken from it. A condition that is
+  // invariant as a whole means the loop runs never or forever, that isn't worth a temporary
+  hoist_invariants(ast[node].a, 1, &loop);
+  hoist_from_statement(ast[node].b, &loop);
+
+  if (loop.num_hoisted > 0)
+  {
+    ast_node loop_node = ast[node];
+    int first = -1, last = -1;
+    for (int i = 0; i < loop.num_hoisted; i++)
+    {
+      int save = new_node(ast_save, 0, loop.temporaries[i], loop.hoisted[i]);
+      if (last == -1)
+        first = save;
+      else
+        ast[last].next = save;
+      last = save;
+    }
+    ast[last].next = new_node(loop_node.kind, loop_node.op, loop_node.a, loop_node.b);
+    ast[node] = (ast_node){ast_begin, 0, first, -1, loop_node.next};
+  }
+  free(loop.stored);
+  free(loop.hoisted);
+  free(loop.temporaries);
+}
+
+// Mark every address a statement (and the statements after it in a begin block) stores to
+void mark_stores(int node, loop_info *loop)
+{
+  for (; node != -1; node = ast[node].next)
+  {
+    switch (ast[node].kind)
+    {
+    case ast_assign:
+    case ast_read:
+      loop->stored[symbol_table[ast[node].a].addr] = 1;
+      break;
+    case ast_save:
+      loop->stored[ast[node].a] = 1;
+      break;
+    case ast_begin:
+      mark_stores(ast[node].a, loop);
+      break;
+    case ast_if:
+    case ast_while:
+      mark_stores(ast[node].b, loop);
+      break;
+    }
+  }
+}
+
+// Hoist the invariants out of the expressions in a loop body's statement and the statements after it, except in the
+// body of an if
+void hoist_from_statement(int node, loop_info *loop)
+{
+  for (; node != -1; node = ast[node].next)
+  {
+    switch (ast[node].kind)
+    {
+    case ast_assign:
+    case ast_save:
+      if (hoist_invariants(ast[node].b, 0, loop))
+        hoist_if_worthwhile(ast[node].b, 0, loop);
+      break;
+    case ast_write:
+      if (hoist_invariants(ast[node].a, 0, loop))
+        hoist_if_worthwhile(ast[node].a, 0, loop);
+      break;
+    case ast_begin:
+      hoist_from_statement(ast[node].a, loop);
+      break;
+    case ast_if:
+      // The body of an if may seldom run, computing its invariants on every trip around the loop could cost more
+      // than it saves
+      if (hoist_invariants(ast[node].a, 0, loop))
+        hoist_if_worthwhile(ast[node].a, 0, loop);
+      break;
+    case ast_while:
+      if (hoist_invariants(ast[node].a, 0, loop))
+        hoist_if_worthwhile(ast[node].a, 0, loop);
+      hoist_from_statement(ast[node].b, loop);
+      break;
+    }
+  }
+}
+
+// Check if an expression only reads addresses the loop never stores to, returning 1 if it does. If it doesn't, its
+// largest parts that do are hoisted instead (always_runs as in hoist_if_worthwhile)
+int hoist_invariants(int node, int always_runs, loop_info *loop)
+{
+  switch (ast[node].kind)
+  {
+  case ast_variable:
+    return !loop->stored[symbol_table[ast[node].a].addr];
+  case ast_temporary:
+    return !loop->stored[ast[node].a];
+  case ast_odd:
+    return hoist_invariants(ast[node].a, always_runs, loop);
+  case ast_operation:
+  {
+    int left = hoist_invariants(ast[node].a, always_runs, loop);
+    int right = hoist_invariants(ast[node].b, always_runs, loop);
+    if (left && right)
+      return 1;
+    if (left)
+      hoist_if_worthwhile(ast[node].a, always_runs, loop);
+    if (right)
+      hoist_if_worthwhile(ast[node].b, always_runs, loop);
+    return 0;
+  }
+  }
+  return 1; // Number
+}
+
+// Hoist an invariant expression unless it's a single load or LIT already, it's made only of numbers (folding those
+// is cheaper), or it may not run on every iteration (always_runs is 0) and could fail, since computing it early
+// could fail a program that wouldn't have
+void hoist_if_worthwhile(int node, int always_runs, loop_info *loop)
+{
+  if (ast[node].kind != ast_operation && ast[node].kind != ast_odd)
+    return;
+  if (is_constant_expression(node) || (!always_runs && can_fail(node)))
+    return;
+
+  // The same expression may appear more than once in the loop, they can share a temporary
+  int i = 0;
+  while (i < loop->num_hoisted && !same_expression(loop->hoisted[i], node))
+    i++;
+  if (i == loop->num_hoisted)
+  {
+    if (loop->num_hoisted == loop->capacity)
+    {
+      loop->capacity = loop->capacity ? loop->capacity * 2 : 8;
+      loop->hoisted = realloc(loop->hoisted, sizeof(int) * loop->capacity);
+      loop->temporaries = realloc(loop->temporaries, sizeof(int) * loop->capacity);
+    }
+    ast_node expression = ast[node];
+    loop->hoisted[i] = new_node(expression.kind, expression.op, expression.a, expression.b);
+    loop->temporaries[i] = 3 + program_vars + num_temporaries++;
+    loop->num_hoisted++;
+  }
+  ast[node] = (ast_node){ast_temporary, 0, loop->temporaries[i], -1, -1};
+  hoisted_expressions++;
+}
+
+// Check if two expressions compute the same thing the same way
+int same_expression(int x, int y)
+{
+  if (ast[x].kind != ast[y].kind || ast[x].op != ast[y].op)
+    return 0;
+  if (ast[x].kind == ast_operation)
+    return same_expression(ast[x].a, ast[y].a) && same_expression(ast[x].b, ast[y].b);
+  if (ast[x].kind == ast_odd)
+    return same_expression(ast[x].a, ast[y].a);
+  return ast[x].a == ast[y].a;
+}
+
+// Check if an expression is made only of numbers
+int is_constant_expression(int node)
+{
+  if (ast[node].kind == ast_operation)
+    return is_constant_expression(ast[node].a) && is_constant_expression(ast[node].b);
+  if (ast[node].kind == ast_odd)
+    return is_constant_expression(ast[node].a);
+  return ast[node].kind == ast_number;
+}
+
+// Check if computing an expression could stop the program with a runtime error, which only division by something
+// other than a nonzero number can
+int can_fail(int node)
+{
+  if (ast[node].kind == ast_operation)
+  {
+    if (ast[node].op == 4 && !(ast[ast[node].b].kind == ast_number && ast[ast[node].b].a != 0))
+      return 1;
+    return can_fail(ast[node].a) || can_fail(ast[node].b);
+  }
+  if (ast[node].kind == ast_odd)
+    return can_fail(ast[node].a);
+  return 0;
+}
+
+// Compute each expression that is repeated within a straight-line run of statements once, saving it in a temporary
+// before the statement that first computes it and loading the temporary everywhere it is used
+void eliminate_common_subexpressions(int root)
+{
+  program_vars = ast[root].a;
+  value_table table = {0};
+  table.stamps = calloc(3 + program_vars + num_temporaries, sizeof(int));
+  number_statement(ast[root].b, &table);
+  eliminate_in_run(&table);
+  free(table.keys);
+  free(table.sizes);
+  free(table.constant);
+  free(table.uses);
+  free(table.last_use);
+  free(table.num_uses);
+  free(table.slots);
+  free(table.stamps);
+  free(table.run);
+  free(table.operations);
+  free(table.candidates);
+}
+
+// Add a statement (and, for a statement in a begin block, the statements after it) to the current run, ending the run
+// wherever control can branch or join. An if's condition still belongs to the run before it
+void number_statement(int node, value_table *table)
+{
+  for (; node != -1; node = ast[node].next)
+  {
+    int kind = ast[node].kind;
+    if (kind == ast_begin)
+    {
+      number_statement(ast[node].a, table);
+      continue;
+    }
+
+    int body = ast[node].b;
+    if (kind != ast_while)
+    {
+      if (table->run_size == table->run_capacity)
+      {
+        table->run_capacity = table->run_capacity ? table->run_capacity * 2 : 64;
+        table->run = realloc(table->run, sizeof(int) * table->run_capacity);
+      }
+      table->run[table->run_size++] = node;
+    }
+    if (kind == ast_if || kind == ast_while)
+    {
+      eliminate_in_run(table); // May move node, but its next and body stay the same
+      number_statement(body, table);
+      eliminate_in_run(table);
+    }
+  }
+}
+
+// Number the values the current run computes and replace every expression computed more than once in it, when
+// computing it once, storing it and loading it at each use takes fewer instructions than computing it at each use
+void eliminate_in_run(value_table *table)
+{
+  table->num_operations = table->num_candidates = 0;
+  for (int i = 0; i < table->run_size; i++)
+  {
+    int node = table->run[i];
+    switch (ast[node].kind)
+    {
+    case ast_assign:
+      number_expression(ast[node].b, i, table);
+      table->stamps[symbol_table[ast[node].a].addr] = ++table->clock;
+      break;
+    case ast_save:
+      number_expression(ast[node].b, i, table);
+      table->stamps[ast[node].a] = ++table->clock;
+      break;
+    case ast_read:
+      table->stamps[symbol_table[ast[node].a].addr] = ++table->clock;
+      break;
+    default: // Write or if
+      number_expression(ast[node].a, i, table);
+    }
+  }
+
+  // Larger expressions go first, so the parts of one already replaced by a temporary no longer count as uses
+  if (table->num_candidates > 1) // candidates is still NULL when the run repeats nothing
+    qsort(table->candidates, table->num_candidates, 2 * sizeof(int), compare_candidates);
+  for (int c = 0; c < table->num_candidates; c++)
+  {
+    int value = table->candidates[2 * c + 1];
+    int size = table->sizes[value];
+    int num_uses = 0;
+    for (int u = table->uses[value]; u != -1; u = table->operations[u].next)
+      num_uses += !table->operations[u].removed;
+    if (num_uses < 2 || (num_uses - 1) * size <= num_uses + 1)
+      continue;
+
+    // Every use computes the same value and nothing between the statements branches or prints, so computing it
+    // before the statement of the first use can't change what the program does, even if it fails
+    int temporary = 3 + program_vars + num_temporaries++;
+    int first = 1;
+    for (int u = table->uses[value]; u != -1; u = table->operations[u].next)
+    {
+      value_use use = table->operations[u];
+      if (use.removed)
+        continue;
+      if (first)
+      {
+        ast_node expression = ast[use.node];
+        int save = new_node(ast_save, 0, temporary, new_node(expression.kind, expression.op, expression.a, expression.b));
+
+        // Statements in a run are never begin blocks, so one that is has already been turned into a block that saves
+        // temporaries before running the statement. Smaller expressions are saved later but may be used by the larger
+        // ones, so each save goes in front
+        int statement = table->run[use.statement];
+        if (ast[statement].kind != ast_begin)
+        {
+          ast_node moved = ast[statement];
+          int moved_node = new_node(moved.kind, moved.op, moved.a, moved.b);
+          ast[statement] = (ast_node){ast_begin, 0, moved_node, -1, moved.next};
+        }
+        ast[save].next = ast[statement].a;
+        ast[statement].a = save;
+        first = 0;
+      }
+      else
+      {
+        for (int i = use.first; i < u; i++)
+          table->operations[i].removed = 1;
+        common_subexpressions++;
+        common_operations_removed += u - use.first + 1;
+      }
+      ast[use.node] = (ast_node){ast_temporary, 0, temporary, -1, -1};
+    }
+  }
+
+  for (int i = 0; i < table->num_operations; i++)
+  {
+    table->uses[table->operations[i].value] = -1;
+    table->num_uses[table->operations[i].value] = 0;
+  }
+  table->run_size = 0;
+}
+
+// Number the value of an expression and the operations in it, recording each operation as computed by a statement of
+// the run, and return the expression's value number
+int number_expression(int node, int statement, value_table *table)
+{
+  // Walk down chains like a - b - c as generate_expression does
+  int start = table->num_operations;
+  int base = chain_size;
+  while (ast[node].kind == ast_operation)
+  {
+    push_chain(node);
+    node = ast[node].a;
+  }
+
+  int value;
+  if (ast[node].kind == ast_number)
+    value = find_value(table, ast_number, 0, ast[node].a, 0, 1, 1);
+  else if (ast[node].kind == ast_variable || ast[node].kind == ast_temporary)
+  {
+    int addr = ast[node].kind == ast_variable ? symbol_table[ast[node].a].addr : ast[node].a;
+    value = find_value(table, ast_variable, 0, addr, table->stamps[addr], 1, 0);
+  }
+  else // Odd
+  {
+    int operand = number_expression(ast[node].a, statement, table);
+    value = find_value(table, ast_odd, 11, operand, 0, table->sizes[operand] + 1, table->constant[operand]);
+  }
+
+  while (chain_size > base)
+  {
+    node = chain[--chain_size];
+    int left = value;
+    int right = number_expression(ast[node].b, statement, table);
+    int op = ast[node].op;
+    if ((op == 1 || op == 3 || op == 5 || op == 6) && left > right) // ADD, MUL, EQL and NEQ don't care about order
+    {
+      int swap = left;
+      left = right;
+      right = swap;
+    }
+    value = find_value(table, ast_operation, op, left, right, table->sizes[left] + table->sizes[right] + 1,
+                       table->constant[left] && table->constant[right]);
+
+    if (table->num_operations == table->operation_capacity)
+    {
+      table->operation_capacity = table->operation_capacity ? table->operation_capacity * 2 : 64;
+      table->operations = realloc(table->operations, sizeof(value_use) * table->operation_capacity);
+    }
+    int u = table->num_operations++;
+    table->operations[u] = (value_use){node, value, statement, start, 0, -1};
+    if (table->uses[value] == -1)
+      table->uses[value] = u;
+    else
+      table->operations[table->last_use[value]].next = u;
+    table->last_use[value] = u;
+
+    // Expressions made only of numbers are left for folding, as hoist_if_worthwhile does
+    if (++table->num_uses[value] == 2 && !table->constant[value])
+    {
+      if (table->num_candidates == table->candidate_capacity)
+      {
+        table->candidate_capacity = table->candidate_capacity ? table->candidate_capacity * 2 : 64;
+        table->candidates = realloc(table->candidates, sizeof(int) * 2 * table->candidate_capacity);
+      }
+      table->candidates[2 * table->num_candidates] = table->sizes[value];
+      table->candidates[2 * table->num_candidates + 1] = value;
+      table->num_candidates++;
+    }
+  }
+  return value;
+}
+
+// Find the value number of a kind of value computed from x and y, numbering it if it's new. size and constant are
+// recorded for a new value
+int find_value(value_table *table, int kind, int op, int x, int y, int size, int constant)
+{
+  if (2 * table->num_values >= table->slot_capacity)
+  {
+    // Grow the hash table, rehashing every value
+    free(table->slots);
+    table->slot_capacity = table->slot_capacity ? table->slot_capacity * 2 : 1024;
+    table->slots = malloc(sizeof(int) * table->slot_capacity);
+    memset(table->slots, -1, sizeof(int) * table->slot_capacity);
+    for (int v = 0; v < table->num_values; v++)
+    {
+      int *key = &table->keys[4 * v];
+      unsigned int slot = hash_value(key[0], key[1], key[2], key[3]) & (table->slot_capacity - 1);
+      while (table->slots[slot] != -1)
+        slot = (slot + 1) & (table->slot_capacity - 1);
+      table->slots[slot] = v;
+    }
+  }
+
+  unsigned int slot = hash_value(kind, op, x, y) & (table->slot_capacity - 1);
+  while (table->slots[slot] != -1)
+  {
+    int *key = &table->keys[4 * table->slots[slot]];
+    if (key[0] == kind && key[1] == op && key[2] == x && key[3] == y)
+      return table->slots[slot];
+    slot = (slot + 1) & (table->slot_capacity - 1);
+  }
+
+  if (table->num_values == table->value_capacity)
+  {
+    table->value_capacity = table->value_capacity ? table->value_capacity * 2 : 1024;
+    table->keys = realloc(table->keys, sizeof(int) * 4 * table->value_capacity);
+    table->sizes = realloc(table->sizes, sizeof(int) * table->value_capacity);
+    table->constant = realloc(table->constant, table->value_capacity);
+    table->uses = realloc(table->uses, sizeof(int) * table->value_capacity);
+    table->last_use = realloc(table->last_use, sizeof(int) * table->value_capacity);
+    table->num_uses = realloc(table->num_uses, sizeof(int) * table->value_capacity);
+  }
+  int v = table->num_values++;
+  table->keys[4 * v] = kind;
+  table->keys[4 * v + 1] = op;
+  table->keys[4 * v + 2] = x;
+  table->keys[4 * v + 3] = y;
+  table->sizes[v] = size;
+  table->constant[v] = constant;
+  table->uses[v] = -1;
+  table->num_uses[v] = 0;
+  table->slots[slot] = v;
+  return v;
+}
+
+// Hash the key of a value for find_value
+unsigned int hash_value(int kind, int op, int x, int y)
+{
+  return (unsigned int)x * 2654435761u ^ (unsigned int)y * 2246822519u ^ (unsigned int)(kind << 8 | op);
+}
+
+// Order candidates from the largest expression to the smallest, then by value number so the order is the same
+// wherever qsort starts
+int compare_candidates(const void *x, const void *y)
+{
+  const int *a = x, *b = y;
+  if (a[0] != b[0])
+    return b[0] - a[0];
+  return a[1] - b[1];
+}
+
+// Generate code for the program's syntax tree
+void generate_program(int root)
+{
+  emit(6, 0, 3 + ast[root].a + num_temporaries); // Emit INC instruction, with room for the temporaries
+  generate_statement(ast[root].b);
+  emit(9, 0, 3); // Emit halt instruction
+}
+
+// Generate code for a statement and, for a statement in a begin block, the statements after it
+void generate_statement(int node)
+{
+  for (; node != -1; node = ast[node].next)
+  {
+    ast_node *n = &ast[node];
+    int sx = n->a;
+    switch (n->kind)
+    {
+    case ast_assign:
+      generate_expression(n->b);
+      emit(4, 0, symbol_table[sx].addr); // Emit STO instruction
+      break;
+    case ast_begin:
+      generate_statement(n->a);
+      break;
+    case ast_if:
+    {
+      generate_expression(n->a);
+      int jx = emit_false_jump(); // Emit JPC instruction
+      generate_statement(n->b);
+      code[jx].m = cx * 3; // Set JPC instruction's M to current code index
+      break;
+    }
+    case ast_while:
+    {
+      int lx = cx;
+      generate_expression(n->a);
+      int jx = emit_false_jump(); // Emit JPC instruction
+      generate_statement(n->b);
+      emit(7, 0, lx * 3);  // Emit JMP instruction
+      code[jx].m = cx * 3; // Set JPC instruction's M to current code index
+      break;
+    }
+    case ast_read:
+      emit(9, 0, 2);                     // Emit SIO instruction
+      emit(4, 0, symbol_table[sx].addr); // Emit STO instruction
+      break;
+    case ast_write:
+      generate_expression(n->a);
+      emit(9, 0, 1); // Emit SIO instruction
+      break;
+    case ast_save:
+      generate_expression(n->b);
+      emit(4, 0, n->a); // Emit STO instruction
+      break;
+    }
+  }
+}
+
+// Push an operation onto chain, growing it if necessary
+void push_chain(int node)
+{
+  if (chain_size == chain_capacity)
+  {
+    chain_capacity = chain_capacity ? chain_capacity * 2 : 64;
+    chain = realloc(chain, sizeof(int) * chain_capacity);
+  }
+  chain[chain_size++] = node;
+}
+
+// Generate code for an expression or condition, returning 1 if it compiled to a single LIT
+int generate_expression(int node)
+{
+  // Chains like a - b - c nest to the left, so walk down the chain pushing each operation and emit them on the way
+  // back up rather than recursing once per operator
+  int base = chain_size;
+  while (ast[node].kind == ast_operation)
+  {
+    push_chain(node);
+    node = ast[node].a;
+  }
+
+  int constant = 0;
+  if (ast[node].kind == ast_number)
+  {
+    emit(1, 0, ast[node].a); // Emit LIT instruction
+    constant = 1;
+  }
+  else if (ast[node].kind == ast_variable)
+  {
+    int sx = ast[node].a;
+    emit(3, level - symbol_table[sx].level, symbol_table[sx].addr); // Emit LOD instruction
+  }
+  else if (ast[node].kind == ast_temporary)
+  {
+    emit(3, 0, ast[node].a); // Emit LOD instruction
+  }
+  else if (generate_expression(ast[node].a) && fold_constants) // Only odd is left, check if its operand is a LIT
+  {
+    code[cx - 1].m &= 1; // Fold ODD into the operand's LIT
+    folded_operations++;
+    constant = 1;
+  }
+  else
+  {
+    emit(2, 0, 11); // Emit ODD instruction
+  }
+
+  while (chain_size > base)
+  {
+    node = chain[--chain_size];
+    int right = generate_expression(ast[node].b);
+    constant = emit_operation(ast[node].op, constant & right);
+  }
+  return constant;
+}
+
+// Emit the jump taken when the condition just compiled is false, returning its index so its M can be patched later.
+// With --fuse-branches a comparison at the end of the condition becomes a branch on the comparison's operands instead:
+// OPR m (EQL..ODD) turns into op m + 5, JNE JEQ JGE JGT JLE JLT JEV, which jumps when the comparison is false
+int emit_false_jump()
+{
+  if (fuse_branches && cx > 0 && code[cx - 1].op == 2 && code[cx - 1].m >= 5 && code[cx - 1].m <= 11)
+  {
+    code[cx - 1].op = code[cx - 1].m + 5;
+    code[cx - 1].m = 0;
+    return cx - 1;
+  }
+  emit(8, 0, 0); // Emit JPC instruction
+  return cx - 1;
+}
+
+// Emit OPR instruction m for the two operands on top of the stack, returning 1 if it was folded into a single LIT.
+// constant_operands is 1 when both operands compiled to a LIT, so they are the last two instructions emitted
+int emit_operation(int m, int constant_operands)
+{
+  int result;
+  if (fold_constants && constant_operands && fold_operation(m, code[cx - 2].m, code[cx - 1].m, &result))
+  {
+    cx--;
+    code[cx - 1].m = result; // Replace both LITs with one LIT of the result
+    folded_operations++;
+    return 1;
+  }
+  emit(2, 0, m);
+  return 0;
+}
+
+// Compute binary OPR instruction m on constants a and b the same way the VM would, returning 0 if it can't be done
+// at compile time (division by zero must still fail when the program runs)
+int fold_operation(int m, int a, int b, int *result)
+{
+  switch (m)
+  {
+  case 1:
+    *result = (int)((unsigned int)a + (unsigned int)b);
+    return 1;
+  case 2:
+    *result = (int)((unsigned int)a - (unsigned int)b);
+    return 1;
+  case 3:
+    *result = (int)((unsigned int)a * (unsigned int)b);
+    return 1;
+  case 4:
+    if (b == 0)
+      return 0;
+    *result = b == -1 ? (int)(0u - (unsigned int)a) : a / b;
+    return 1;
+  case 5:
+    *result = a == b;
+    return 1;
+  case 6:
+    *result = a != b;
+    return 1;
+  case 7:
+    *result = a < b;
+    return 1;
+  case 8:
+    *result = a <= b;
+    return 1;
+  case 9:
+    *result = a > b;
+    return 1;
+  case 10:
+    *result = a >= b;
+    return 1;
+  }
+  return 0;
+}
+
+// Get the index of the instruction a JMP, JPC, fused branch or CAL at code[i] goes to, or -1 if it isn't one of those
+// or its address doesn't name an instruction (cx is the end of the code)
+int jump_target(int i)
+{
+  int op = code[i].op;
+  int m = code[i].m;
+  if ((op == 5 || op == 7 || op == 8 || (op >= 10 && op <= 16)) && m >= 0 && m % 3 == 0 && m / 3 <= cx)
+    return m / 3;
+  return -1;
+}
+
+// Run the enabled peephole rules over the code until none of them apply, returning 1 if any of them did
+int peephole()
+{
+  char *is_target = malloc(cx + 1);
+  int changed = 1;
+  int changed_any = 0;
+  while (changed)
+  {
+    changed = 0;
+
+    // A rule may only remove the first instruction of its window if something jumps into it, since removing the
+    // instruction after a jump target would change what that jump does
+    memset(is_target, 0, cx + 1);
+    for (int i = 0; i < cx; i++)
+    {
+      if (jump_target(i) >= 0)
+        is_target[jump_target(i)] = 1;
+    }
+
+    for (int i = 0; i < cx; i++)
+    {
+      for (int r = 0; r < NUM_PEEPHOLE_RULES && code[i].op != 0; r++)
+      {
+        peephole_rule *rule = &peephole_rules[r];
+        int end = i + rule->window;
+        if (!rule->enabled || end > cx)
+          continue;
+        int j = i + 1;
+        while (j < end && code[j].op != 0 && !is_target[j])
+          j++;
+        if (j < end || !rule->apply(i))
+          continue;
+
+        rule->applied++;
+        for (j = i; j < end; j++)
+          rule->removed += code[j].op == 0;
+        changed = changed_any = 1;
+      }
+    }
+    remove_marked_instructions();
+  }
+  free(is_target);
+  return changed_any;
+}
+
+// Remove instructions marked with op 0, re-patching every jump address to its instruction's new index. A jump to a
+// removed instruction goes to the next one kept
+void remove_marked_instructions()
+{
+  int *new_index = malloc(sizeof(int) * (cx + 1));
+  int n = 0;
+  for (int i = 0; i < cx; i++)
+  {
+    new_index[i] = n;
+    if (code[i].op != 0)
+      code[n++] = code[i];
+  }
+  new_index[cx] = n;
+  for (int i = 0; i < n; i++)
+  {
+    int target = jump_target(i); // Still checked against the old cx, like the address it came from
+    if (target >= 0)
+      code[i].m = new_index[target] * 3;
+  }
+  cx = n;
+  free(new_index);
+}
+
+// Split the code into basic blocks and link each to the blocks that can run after it, returning the number of blocks.
+// A block starts at the first instruction, at every jump target and after every jump, branch, call, return or halt
+int build_cfg(basic_block **blocks)
+{
+  char *is_leader = calloc(cx + 1, 1);
+  is_leader[0] = 1;
+  for (int i = 0; i < cx; i++)
+  {
+    if (jump_target(i) >= 0)
+      is_leader[jump_target(i)] = 1;
+    if (ends_block(i))
+      is_leader[i + 1] = 1;
+  }
+
+  // Number the blocks, remembering the block each instruction is in
+  int *block_of = malloc(sizeof(int) * (cx + 1));
+  int num_blocks = 0;
+  for (int i = 0; i < cx; i++)
+  {
+    num_blocks += is_leader[i];
+    block_of[i] = num_blocks - 1;
+  }
+  block_of[cx] = -1; // Running off the end of the code isn't a block
+
+  *blocks = malloc(sizeof(basic_block) * (num_blocks + 1));
+  for (int i = 0, b = -1; i < cx; i++)
+  {
+    if (is_leader[i])
+      (*blocks)[++b].start = i;
+    (*blocks)[b].end = i + 1;
+  }
+
+  for (int b = 0; b < num_blocks; b++)
+  {
+    basic_block *block = &(*blocks)[b];
+    int last = block->end - 1;
+    int op = code[last].op;
+    block->next = -1;
+    block->target = -1;
+    block->reachable = 0;
+    // Halting and returning (to an address only known at run time, after some CAL) don't fall through
+    if (op != 7 && !(op == 9 && code[last].m == 3) && !(op == 2 && code[last].m == 0))
+      block->next = block_of[block->end];
+    if (jump_target(last) >= 0)
+      block->target = block_of[jump_target(last)];
+  }
+
+  // Find the blocks reachable from the first one
+  int *pending = malloc(sizeof(int) * (num_blocks + 1));
+  int num_pending = 0;
+  if (num_blocks > 0)
+  {
+    (*blocks)[0].reachable = 1;
+    pending[num_pending++] = 0;
+  }
+  while (num_pending > 0)
+  {
+    basic_block *block = &(*blocks)[pending[--num_pending]];
+    int successors[2] = {block->next, block->target};
+    for (int s = 0; s < 2; s++)
+    {
+      if (successors[s] >= 0 && !(*blocks)[successors[s]].reachable)
+      {
+        (*blocks)[successors[s]].reachable = 1;
+        pending[num_pending++] = successors[s];
+      }
+    }
+  }
+
+  free(is_leader);
+  free(block_of);
+  free(pending);
+  return num_blocks;
+}
+
+// Check if the instruction at code[i] is the last one of its basic block
+int ends_block(int i)
+{
+  int op = code[i].op;
+  return op == 5 || op == 7 || op == 8 || (op >= 10 && op <= 16) || (op == 2 && code[i].m == 0) ||
+         (op == 9 && code[i].m == 3);
+}
+
+// Remove the basic blocks that can never run, returning the number of instructions removed
+int eliminate_dead_code()
+{
+  basic_block *blocks;
+  int num_blocks = build_cfg(&blocks);
+  int removed = 0;
+  for (int b = 0; b < num_blocks; b++)
+  {
+    if (blocks[b].reachable)
+      continue;
+    for (int i = blocks[b].start; i < blocks[b].end; i++)
+      code[i].op = 0;
+    removed += blocks[b].end - blocks[b].start;
+    dead_blocks_removed++;
+  }
+  free(blocks);
+  remove_marked_instructions();
+  dead_instructions_removed += removed;
+  return removed;
+}
+
+// Find the number of stack addresses the code loads and stores, returning 0 if the dataflow passes can't follow them:
+// a call, a return or an access to another activation record means addresses don't name one variable each
+int count_addresses()
+{
+  int num_addresses = 0;
+  for (int i = 0; i < cx; i++)
+  {
+    int op = code[i].op;
+    if (op == 5 || (op == 2 && code[i].m == 0) || ((op == 3 || op == 4) && (code[i].l != 0 || code[i].m < 0)))
+      return 0;
+    if ((op == 3 || op == 4) && code[i].m >= num_addresses)
+      num_addresses = code[i].m + 1;
+  }
+  return num_addresses;
+}
+
+// Find the first instruction of the range computing the value the instruction at code[i] pops, returning -1 if the
+// range doesn't lie within the block starting at code[start] or could do more than compute the value. Only LIT, LOD
+// and OPR arithmetic and comparisons are pure, and a DIV only when it divides by a nonzero LIT, since it could fail
+int pure_producer(int start, int i)
+{
+  int needed = 1; // Num of values still to find pushed
+  for (int j = i - 1; j >= start; j--)
+  {
+    int op = code[j].op, m = code[j].m;
+    if (op == 1 || op == 3)
+      needed--;
+    else if (op == 2 && m == 11)
+      ; // ODD replaces the value on top
+    else if (op == 2 && m >= 1 && m <= 10 && (m != 4 || (j > start && code[j - 1].op == 1 && code[j - 1].m != 0)))
+      needed++; // Pops two values, pushes one
+    else
+      return -1;
+    if (needed == 0)
+      return j;
+  }
+  return -1;
+}
+
+// Remove stores whose value is never loaded before it's stored again or the program halts, along with the code
+// computing the value, returning the number of instructions removed. Which addresses are live (may still be loaded)
+// at the end of each basic block is found by iterating over the control flow graph until nothing changes
+int remove_dead_stores()
+{
+  int num_addresses = count_addresses();
+  if (num_addresses == 0)
+    return 0;
+  basic_block *blocks;
+  int num_blocks = build_cfg(&blocks);
+  int words = (num_addresses + 63) / 64;
+  if ((long long)num_blocks * words > DATAFLOW_LIMIT)
+  {
+    free(blocks);
+    return 0;
+  }
+
+  // Addresses each block loads before storing (uses) and stores (defs), and those live when it starts and ends
+  unsigned long long *uses = calloc((size_t)num_blocks * words, sizeof(unsigned long long));
+  unsigned long long *defs = calloc((size_t)num_blocks * words, sizeof(unsigned long long));
+  unsigned long long *live_in = calloc((size_t)num_blocks * words, sizeof(unsigned long long));
+  unsigned long long *live_out = calloc((size_t)num_blocks * words, sizeof(unsigned long long));
+  unsigned long long *live = malloc(sizeof(unsigned long long) * words);
+  for (int b = 0; b < num_blocks; b++)
+  {
+    unsigned long long *use = uses + (size_t)b * words, *def = defs + (size_t)b * words;
+    for (int i = blocks[b].start; i < blocks[b].end; i++)
+    {
+      int m = code[i].m;
+      if (code[i].op == 3 && !(def[m / 64] >> (m % 64) & 1))
+        use[m / 64] |= 1ull << (m % 64);
+      else if (code[i].op == 4)
+        def[m / 64] |= 1ull << (m % 64);
+    }
+  }
+
+  // Nothing is live after a halt, so live_out starts empty everywhere and only grows
+  int changed = 1;
+  while (changed)
+  {
+    changed = 0;
+    for (int b = num_blocks - 1; b >= 0; b--)
+    {
+      unsigned long long *out = live_out + (size_t)b * words, *in = live_in + (size_t)b * words;
+      int successors[2] = {blocks[b].next, blocks[b].target};
+      for (int s = 0; s < 2; s++)
+      {
+        for (int w = 0; successors[s] >= 0 && w < words; w++)
+          out[w] |= live_in[(size_t)successors[s] * words + w];
+      }
+      for (int w = 0; w < words; w++)
+      {
+        unsigned long long word = uses[(size_t)b * words + w] | (out[w] & ~defs[(size_t)b * words + w]);
+        if (word != in[w])
+        {
+          in[w] = word;
+          changed = 1;
+        }
+      }
+    }
+  }
+
+  // Walk each block backwards from what's live at its end, removing stores to addresses that aren't live
+  int removed = 0;
+  for (int b = 0; b < num_blocks; b++)
+  {
+    memcpy(live, live_out + (size_t)b * words, sizeof(unsigned long long) * words);
+    for (int i = blocks[b].end - 1; i >= blocks[b].start; i--)
+    {
+      int m = code[i].m;
+      if (code[i].op == 3)
+        live[m / 64] |= 1ull << (m % 64);
+      else if (code[i].op == 4 && (live[m / 64] >> (m % 64) & 1))
+        live[m / 64] &= ~(1ull << (m % 64));
+      else if (code[i].op == 4)
+      {
+        int start = pure_producer(blocks[b].start, i);
+        if (start < 0)
+          continue; // The value has to be computed anyway, and there's no instruction to discard it
+        for (int j = start; j <= i; j++)
+          code[j].op = 0;
+        removed += i - start + 1;
+        dead_stores_removed++;
+        i = start; // The loads in the removed range don't make anything live
+      }
+    }
+  }
+
+  free(blocks);
+  free(uses);
+  free(defs);
+  free(live_in);
+  free(live_out);
+  free(live);
+  remove_marked_instructions();
+  dead_store_instructions_removed += removed;
+  return removed;
+}
+
+// Replace loads of an address that holds the same known constant on every path to the load with a LIT of it,
+// returning the number of loads replaced. An address holds a known constant after a LIT is stored to it, the value at
+// the start of each basic block is found by iterating over the control flow graph until nothing changes
+int replace_constant_loads()
+{
+  int num_addresses = count_addresses();
+  if (num_addresses == 0)
+    return 0;
+  basic_block *blocks;
+  int num_blocks = build_cfg(&blocks);
+  if ((long long)num_blocks * num_addresses > DATAFLOW_LIMIT)
+  {
+    free(blocks);
+    return 0;
+  }
+
+  // The state of each address at the start of each block: unset until some path reaches it, then a known constant,
+  // or varying once paths disagree. The first block starts with every address varying
+  size_t size = (size_t)num_blocks * num_addresses;
+  unsigned char *states = calloc(size, 1);
+  int *values = calloc(size, sizeof(int));
+  unsigned char *state = malloc(num_addresses);
+  int *value = malloc(sizeof(int) * num_addresses);
+  memset(states, VALUE_VARYING, num_addresses);
+
+  int changed = 1;
+  while (changed)
+  {
+    changed = 0;
+    for (int b = 0; b < num_blocks; b++)
+    {
+      if (!blocks[b].reachable)
+        continue;
+      memcpy(state, states + (size_t)b * num_addresses, num_addresses);
+      memcpy(value, values + (size_t)b * num_addresses, sizeof(int) * num_addresses);
+      for (int i = blocks[b].start; i < blocks[b].end; i++)
+      {
+        if (code[i].op == 4 && i > blocks[b].start && code[i - 1].op == 1)
+        {
+          state[code[i].m] = VALUE_CONSTANT;
+          value[code[i].m] = code[i - 1].m;
+        }
+        else if (code[i].op == 4)
+          state[code[i].m] = VALUE_VARYING;
+      }
+
+      // Merge the state at the end of the block into the start of its successors
+      int successors[2] = {blocks[b].next, blocks[b].target};
+      for (int s = 0; s < 2; s++)
+      {
+        if (successors[s] < 0)
+          continue;
+        unsigned char *to_state = states + (size_t)successors[s] * num_addresses;
+        int *to_value = values + (size_t)successors[s] * num_addresses;
+        for (int a = 0; a < num_addresses; a++)
+        {
+          unsigned char merged;
+          if (to_state[a] == VALUE_UNSET || state[a] == VALUE_UNSET)
+            merged = to_state[a] == VALUE_UNSET ? state[a] : to_state[a];
+          else if (to_state[a] == VALUE_CONSTANT && state[a] == VALUE_CONSTANT && to_value[a] == value[a])
+            merged = VALUE_CONSTANT;
+          else
+            merged = VALUE_VARYING;
+          if (merged != to_state[a])
+          {
+            to_state[a] = merged;
+            to_value[a] = value[a];
+            changed = 1;
+          }
+        }
+      }
+    }
+  }
+
+  // Replace the loads, following the state through each block from its start
+  int replaced = 0;
+  for (int b = 0; b < num_blocks; b++)
+  {
+    memcpy(state, states + (size_t)b * num_addresses, num_addresses);
+    memcpy(value, values + (size_t)b * num_addresses, sizeof(int) * num_addresses);
+    for (int i = blocks[b].start; i < blocks[b].end; i++)
+    {
+      int m = code[i].m;
+      if (code[i].op == 3 && state[m] == VALUE_CONSTANT)
+      {
+        code[i] = (instruction){1, 0, value[m]};
+        replaced++;
+      }
+      else if (code[i].op == 4 && i > blocks[b].start && code[i - 1].op == 1)
+      {
+        state[m] = VALUE_CONSTANT;
+        value[m] = code[i - 1].m;
+      }
+      else if (code[i].op == 4)
+        state[m] = VALUE_VARYING;
+    }
+  }
+
+  free(blocks);
+  free(states);
+  free(values);
+  free(state);
+  free(value);
+  constant_loads_replaced += replaced;
+  return replaced;
+}
+
+// Run the enabled code optimizations until none of them change the code, since each can make work for the others:
+// removing dead code can leave a jump to the next instruction, the peephole rules can turn a branch into a jump over
+// code that is then dead, and replacing the loads of a constant can leave the store of it dead. The dataflow passes
+// can make work for themselves too: a load replaced by a LIT can be stored as a new known constant, and a removed
+// store can leave an earlier store dead
+void optimize_code()
+{
+  int changed = 1;
+  while (changed)
+  {
+    changed = 0;
+    if (constant_loads_enabled)
+      changed |= replace_constant_loads() > 0;
+    if (dead_stores_enabled)
+      changed |= remove_dead_stores() > 0;
+    if (peephole_enabled)
+      changed |= peephole();
+    if (remove_dead)
+      changed |= eliminate_dead_code() > 0;
+  }
+}
+
+// Write the control flow graph of the code to a file, as a Graphviz digraph if its name ends in .dot and as text
+// otherwise, returning 1 on success. Blocks that jump back to an earlier block are loops, their target is marked as
+// a loop header
+int write_cfg(const char *path)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return 0;
+  basic_block *blocks;
+  int num_blocks = build_cfg(&blocks);
+  size_t length = strlen(path);
+  int dot = length >= 4 && strcmp(path + length - 4, ".dot") == 0;
+
+  // A block is a loop header if some block at or after it jumps back to it
+  char *is_header = calloc(num_blocks + 1, 1);
+  for (int b = 0; b < num_blocks; b++)
+  {
+    if (blocks[b].target >= 0 && blocks[b].target <= b)
+      is_header[blocks[b].target] = 1;
+  }
+
+  if (dot)
+    fprintf(file, "digraph cfg\n{\n  node [shape=box, fontname=\"monospace\"];\n");
+  for (int b = 0; b < num_blocks; b++)
+  {
+    basic_block *block = &blocks[b];
+    if (dot)
+    {
+      fprintf(file, "  b%d [label=\"block %d%s%s\\l", b, b, is_header[b] ? " (loop header)" : "",
+              block->reachable ? "" : " (unreachable)");
+      for (int i = block->start; i < block->end; i++)
+      {
+        char name[4];
+        get_op_name(code[i].op, name);
+        fprintf(file, "%d %s %d %d\\l", i, name, code[i].l, code[i].m);
+      }
+      fprintf(file, "\"%s];\n", is_header[b] ? ", style=bold" : "");
+      if (block->next >= 0)
+        fprintf(file, "  b%d -> b%d;\n", b, block->next);
+      if (block->target >= 0)
+        fprintf(file, "  b%d -> b%d [label=\"%s\"%s];\n", b, block->target,
+                code[block->end - 1].op == 7 ? "jump" : "taken", block->target <= b ? ", style=bold" : "");
+    }
+    else
+    {
+      fprintf(file, "Block %d: lines %d-%d", b, block->start, block->end - 1);
+      if (is_header[b])
+        fprintf(file, ", loop header");
+      if (!block->reachable)
+        fprintf(file, ", unreachable");
+      fprintf(file, "\n");
+      for (int i = block->start; i < block->end; i++)
+      {
+        char name[4];
+        get_op_name(code[i].op, name);
+        fprintf(file, "%10d %10s %10d %10d\n", i, name, code[i].l, code[i].m);
+      }
+      fprintf(file, "  successors:");
+      if (block->next >= 0)
+        fprintf(file, " %d", block->next);
+      if (block->target >= 0)
+        fprintf(file, " %d (%s)", block->target, code[block->end - 1].op == 7 ? "jump" : "taken");
+      fprintf(file, block->next < 0 && block->target < 0 ? " none\n" : "\n");
+    }
+  }
+  if (dot)
+    fprintf(file, "}\n");
+
+  free(blocks);
+  free(is_header);
+  return fclose(file) == 0;
+}
+
+// Write the program's syntax tree to a file as a standalone C program that prints the same output and stops with the
+// same status as the VM running its code, returning 1 on success. Variables become locals of main named after them
+// with a v_ prefix, temporaries the optimizer added become t followed by their address, and arithmetic goes through
+// functions that wrap around and report division by zero the way the VM does
+int write_c(int root, const char *path)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return 0;
+
+  fprintf(file, "#include <stdio.h>\n#include <stdlib.h>\n\n");
+  fprintf(file, "static void fail(const char *message)\n{\n");
+  fprintf(file, "  fprintf(stderr, \"Runtime error: %%s\\n\", message);\n  fflush(stdout);\n  exit(1);\n}\n\n");
+  fprintf(file, "static int add(int a, int b) { return (int)((unsigned int)a + (unsigned int)b); }\n");
+  fprintf(file, "static int sub(int a, int b) { return (int)((unsigned int)a - (unsigned int)b); }\n");
+  fprintf(file, "static int mul(int a, int b) { return (int)((unsigned int)a * (unsigned int)b); }\n\n");
+  fprintf(file, "static int divide(int a, int b)\n{\n  if (b == 0)\n    fail(\"division by zero\");\n");
+  fprintf(file, "  return b == -1 ? (int)(0u - (unsigned int)a) : a / b;\n}\n\n");
+  fprintf(file, "static int read_int(void)\n{\n  int value;\n  if (scanf(\"%%d\", &value) != 1)\n");
+  fprintf(file, "    fail(\"could not read an integer\");\n  return value;\n}\n\n");
+
+  fprintf(file, "int main(void)\n{\n");
+  for (int i = 0; i < tx; i++)
+  {
+    if (symbol_table[i].kind == 2)
+      fprintf(file, "  int v_%s = 0;\n", symbol_table[i].name);
+  }
+  for (int i = 0; i < num_temporaries; i++)
+    fprintf(file, "  int t%d = 0;\n", 3 + ast[root].a + i);
+  write_c_statement(file, ast[root].b, 1);
+  fprintf(file, "  return 0;\n}\n");
+  return fclose(file) == 0;
+}
+
+// Write a statement and, for a statement in a begin block, the statements after it as C indented depth levels
+void write_c_statement(FILE *file, int node, int depth)
+{
+  for (; node != -1; node = ast[node].next)
+  {
+    ast_node *n = &ast[node];
+    fprintf(file, "%*s", 2 * depth, "");
+    switch (n->kind)
+    {
+    case ast_assign:
+      fprintf(file, "v_%s = ", symbol_table[n->a].name);
+      write_c_expression(file, n->b);
+      fprintf(file, ";\n");
+      break;
+    case ast_save:
+      fprintf(file, "t%d = ", n->a);
+      write_c_expression(file, n->b);
+      fprintf(file, ";\n");
+      break;
+    case ast_begin:
+      fprintf(file, "{\n");
+      write_c_statement(file, n->a, depth + 1);
+      fprintf(file, "%*s}\n", 2 * depth, "");
+      break;
+    case ast_if:
+    case ast_while:
+      fprintf(file, n->kind == ast_if ? "if (" : "while (");
+      write_c_expression(file, n->a);
+      fprintf(file, ")\n%*s{\n", 2 * depth, "");
+      write_c_statement(file, n->b, depth + 1);
+      fprintf(file, "%*s}\n", 2 * depth, "");
+      break;
+    case ast_read:
+      fprintf(file, "v_%s = read_int();\n", symbol_table[n->a].name);
+      break;
+    case ast_write:
+      fprintf(file, "printf(\"%%d\\n\", ");
+      write_c_expression(file, n->a);
+      fprintf(file, ");\n");
+      break;
+    }
+  }
+}
+
+// Write an expression as C
+void write_c_expression(FILE *file, int node)
+{
+  // Text before the left operand and between the operands of each operator, indexed by OPR M
+  static const char *const before[] = {"", "add(", "sub(", "mul(", "divide(", "(", "(", "(", "(", "(", "("};
+  static const char *const between[] = {"", ", ", ", ", ", ", ", ", " == ", " != ", " < ", " <= ", " > ", " >= "};
+
+  // Walk down chains like a - b - c as generate_expression does, writing each operator's opening as it's reached
+  int base = chain_size;
+  while (ast[node].kind == ast_operation)
+  {
+    push_chain(node);
+    fprintf(file, "%s", before[ast[node].op]);
+    node = ast[node].a;
+  }
+
+  if (ast[node].kind == ast_number)
+    fprintf(file, ast[node].a < 0 ? "(%d)" : "%d", ast[node].a);
+  else if (ast[node].kind == ast_variable)
+    fprintf(file, "v_%s", symbol_table[ast[node].a].name);
+  else if (ast[node].kind == ast_temporary)
+    fprintf(file, "t%d", ast[node].a);
+  else // Odd
+  {
+    fprintf(file, "(");
+    write_c_expression(file, ast[node].a);
+    fprintf(file, " & 1)");
+  }
+
+  while (chain_size > base)
+  {
+    node = chain[--chain_size];
+    fprintf(file, "%s", between[ast[node].op]);
+    write_c_expression(file, ast[node].b);
+    fprintf(file, ")");
+  }
+}
+
+// JMP to the next instruction does nothing
+int peephole_jump_next(int i)
+{
+  if (code[i].op != 7 || jump_target(i) != i + 1)
+    return 0;
+  code[i].op = 0;
+  return 1;
+}
+
+// JMP, JPC or a fused branch to a JMP can go straight to where that JMP goes
+int peephole_jump_chain(int i)
+{
+  if (code[i].op == 5 || jump_target(i) < 0)
+    return 0;
+  int target = jump_target(i);
+  for (int steps = 0; target >= 0 && target < cx && code[target].op == 7 && steps < cx; steps++)
+    target = jump_target(target);
+  if (target < 0 || target == jump_target(i))
+    return 0;
+  code[i].m = target * 3;
+  return 1;
+}
+
+// Adding or subtracting 0 and multiplying or dividing by 1 leave the other operand unchanged
+int peephole_identity(int i)
+{
+  if (code[i].op != 1 || code[i + 1].op != 2)
+    return 0;
+  int m = code[i + 1].m;
+  if (!(code[i].m == 0 && (m == 1 || m == 2)) && !(code[i].m == 1 && (m == 3 || m == 4)))
+    return 0;
+  code[i].op = code[i + 1].op = 0;
+  return 1;
+}
+
+// Storing a variable's own value back into it does nothing
+int peephole_load_store(int i)
+{
+  if (code[i].op != 3 || code[i + 1].op != 4 || code[i].l != code[i + 1].l || code[i].m != code[i + 1].m)
+    return 0;
+  code[i].op = code[i + 1].op = 0;
+  return 1;
+}
+
+// A JPC on a constant either always jumps (0) or never does
+int peephole_constant_branch(int i)
+{
+  if (code[i].op != 1 || code[i + 1].op != 8)
+    return 0;
+  if (code[i].m == 0)
+    code[i] = (instruction){7, 0, code[i + 1].m};
+  else
+    code[i].op = 0;
+  code[i + 1].op = 0;
+  return 1;
+}
+
+// Enable the peephole rules named in a comma separated list, or every rule if names is NULL, returning 0 if a name
+// isn't a rule
+int select_peephole_rules(const char *names)
+{
+  for (int r = 0; r < NUM_PEEPHOLE_RULES; r++)
+    peephole_rules[r].enabled = names == NULL;
+  while (names != NULL)
+  {
+    const char *comma = strchr(names, ',');
+    size_t length = comma != NULL ? (size_t)(comma - names) : strlen(names);
+    int r = 0;
+    while (r < NUM_PEEPHOLE_RULES &&
+           !(strlen(peephole_rules[r].name) == length && strncmp(peephole_rules[r].name, names, length) == 0))
+      r++;
+    if (r == NUM_PEEPHOLE_RULES)
+      return 0;
+    peephole_rules[r].enabled = 1;
+    names = comma != NULL ? comma + 1 : NULL;
   }
+  return 1;
 }
 
-// Print an error message and exit
-void error(int error_code)
+// Print symbol table
+void print_symbol_table()
 {
-  print_both("Error: ");
-  switch (error_code)
+  print_both("\nSymbol Table:\n");
+  print_both("%10s | %10s | %10s | %10s | %10s | %10s\n", "Kind", "Name", "Value", "Level", "Address", "Mark", "\n");
+  print_both("    -----------------------------------------------------------------------\n");
+
+  for (int i = 0; i < tx; i++)
+  {
+    symbol_table[i].mark = 1;
+
+    // Same layout as "%10d | %10s | %10d | %10d | %10d | %10d\n", with "-" for a constant's level and address
+    append_padded_int(symbol_table[i].kind, 10);
+    append_output(" | ", 3);
+    append_padded_string(symbol_table[i].name, 10);
+    append_output(" | ", 3);
+    append_padded_int(symbol_table[i].val, 10);
+    append_output(" | ", 3);
+    if (symbol_table[i].kind == 1)
+    {
+      append_padded_string("-", 10);
+      append_output(" | ", 3);
+      append_padded_string("-", 10);
+    }
+    else
+    {
+      append_padded_int(symbol_table[i].level, 10);
+      append_output(" | ", 3);
+      append_padded_int(symbol_table[i].addr, 10);
+    }
+    append_output(" | ", 3);
+    append_padded_int(symbol_table[i].mark, 10);
+    append_output("\n", 1);
+
+    if (output_size >= OUTPUT_FLUSH_SIZE)
+      flush_output();
+  }
+}
+
+// Print assmebly code
+void print_instructions()
+{
+
+  print_both("Assembly Code:\n");
+  print_both("%10s %10s %10s %10s\n", "Line", "OP", "L", "M");
+  for (int i = 0; i < cx; i++)
+  {
+    char name[4];
+    get_op_name(code[i].op, name);
+
+    // Same layout as "%10d %10s %10d %10d\n"
+    append_padded_int(i, 10);
+    append_output(" ", 1);
+    append_padded_string(name, 10);
+    append_output(" ", 1);
+    append_padded_int(code[i].l, 10);
+    append_output(" ", 1);
+    append_padded_int(code[i].m, 10);
+    append_output("\n", 1);
+
+    if (output_size >= OUTPUT_FLUSH_SIZE)
+      flush_output();
+  }
+}
+
+// Get op name from op code
+void get_op_name(int op, char *name)
+{
+  switch (op)
   {
   case 1:
-    print_both("program must end with a period\n");
+    strcpy(name, "LIT");
     break;
   case 2:
-    print_both("const, var, and read keywords must be followed by identifier\n");
+    strcpy(name, "OPR");
     break;
   case 3:
-    print_both("symbol name has already been declared\n");
+    strcpy(name, "LOD");
     break;
   case 4:
-    print_both("constants must be assigned with =\n");
+    strcpy(name, "STO");
     break;
   case 5:
-    print_both("constants must be assigned an integer value\n");
+    strcpy(name, "CAL");
     break;
   case 6:
-    print_both("constant and variables declarations must be followed by a semicolon\n");
+    strcpy(name, "INC");
     break;
   case 7:
-    print_both("undeclared identifier %s\n", current_token.lexeme);
+    strcpy(name, "JMP");
     break;
   case 8:
-    print_both("only variable values may be altered\n");
+    strcpy(name, "JPC");
     break;
   case 9:
-    print_both("assignment statements must use :=\n");
+    strcpy(name, "SYS");
     break;
   case 10:
-    print_both("begin must be followed by end\n");
+    strcpy(name, "JNE");
     break;
   case 11:
-    print_both("if must be followed by then\n");
+    strcpy(name, "JEQ");
     break;
   case 12:
-    print_both("while must be followed by do\n");
+    strcpy(name, "JGE");
     break;
   case 13:
-    print_both("condition must contain comparison operator\n");
+    strcpy(name, "JGT");
     break;
   case 14:
-    print_both("right parenthesis must follow left parenthesis\n");
+    strcpy(name, "JLE");
     break;
   case 15:
-    print_both("arithmetic equations must contain operands, parenthesis, numbers, or symbols\n");
+    strcpy(name, "JLT");
     break;
   case 16:
-    print_both("program too long\n");
+    strcpy(name, "JEV");
+    break;
   }
-  exit(1);
 }
 
-// Check if a symbol is in the symbol table
-int check_symbol_table(char *string)
+// Write the code array (and the symbol table unless stripped) to a binary object file, returning 1 on success
+int write_object(const char *path)
+{
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+    return 0;
+
+  // Build the object after any output still waiting in the buffer, then take it back out
+  size_t start = output_size;
+  append_object(!strip_symbols);
+  int ok = fwrite(output_buffer + start, 1, output_size - start, file) == output_size - start;
+  bytes_written += output_size - start;
+  output_size = start;
+
+  return fclose(file) == 0 && ok;
+}
+
+// Append the code array (and the symbol table if asked to) to the output buffer as a binary object
+void append_object(int include_symbols)
+{
+  object_header header;
+  memcpy(header.magic, OBJECT_MAGIC, 4);
+  header.version = OBJECT_VERSION;
+  header.byte_order = OBJECT_BYTE_ORDER;
+  header.num_instructions = cx;
+  header.num_symbols = include_symbols ? tx : 0;
+  append_output((const char *)&header, sizeof(header));
+  append_output((const char *)code, sizeof(instruction) * cx);
+
+  for (int i = 0; i < header.num_symbols; i++)
+  {
+    object_symbol record;
+    memset(&record, 0, sizeof(record));
+    record.kind = symbol_table[i].kind;
+    strcpy(record.name, symbol_table[i].name);
+    record.val = symbol_table[i].val;
+    record.level = symbol_table[i].level;
+    record.addr = symbol_table[i].addr;
+    record.mark = symbol_table[i].mark;
+    append_output((const char *)&record, sizeof(record));
+  }
+}
+
+// Fill the code array and symbol table from a binary object file's contents, returning 0 if they aren't valid
+int load_object(const char *data, size_t length)
+{
+  object_header header;
+  if (length < sizeof(header))
+    return 0;
+  memcpy(&header, data, sizeof(header));
+
+  // Check the header before trusting any of its counts
+  if (memcmp(header.magic, OBJECT_MAGIC, 4) != 0 || header.version != OBJECT_VERSION ||
+      header.byte_order != OBJECT_BYTE_ORDER || header.num_instructions < 0 || header.num_symbols < 0)
+    return 0;
+  size_t expected = sizeof(header) + sizeof(instruction) * (size_t)header.num_instructions +
+                    sizeof(object_symbol) * (size_t)header.num_symbols;
+  if (length != expected)
+    return 0;
+
+  // Loaded code was already compiled, so it isn't held to the --max-code limit
+  reserve_code(header.num_instructions);
+  memcpy(code, data + sizeof(header), sizeof(instruction) * header.num_instructions);
+  cx = header.num_instructions;
+
+  const char *symbols = data + sizeof(header) + sizeof(instruction) * header.num_instructions;
+  for (int i = 0; i < header.num_symbols; i++)
+  {
+    object_symbol record;
+    memcpy(&record, symbols + sizeof(record) * i, sizeof(record));
+    record.name[MAX_IDENTIFIER_LENGTH] = '\0';
+    add_symbol(record.kind, intern_name(&names, record.name, strlen(record.name)), record.val, record.level,
+               record.addr, record.mark);
+  }
+  return 1;
+}
+
+// Find the --cache entry for the loaded source and the options, writing its path and the text it must start with. The
+// file is named by a hash of CACHE_VERSION, the options that change the code, and the source, and the entry
+// repeats all of them so a hash collision is caught instead of loading the wrong code
+void cache_entry(char *path, size_t path_size, char *prefix, size_t prefix_size)
+{
+  char rules[NUM_PEEPHOLE_RULES + 1];
+  for (int i = 0; i < NUM_PEEPHOLE_RULES; i++)
+    rules[i] = peephole_enabled && peephole_rules[i].enabled ? '1' : '0';
+  rules[NUM_PEEPHOLE_RULES] = '\0';
+  snprintf(prefix, prefix_size, "%d %d %d %d %d %d %d %d %d %d %d %s %zu\n", CACHE_VERSION, OBJECT_VERSION, max_code,
+           max_symbols, fold_constants, fuse_branches, hoist_invariants_enabled, common_subexprs_enabled,
+           dead_stores_enabled, constant_loads_enabled, remove_dead, rules, source_length);
+
+  unsigned long long hash = hash_bytes(14695981039346656037ull, prefix, strlen(prefix));
+  hash = hash_bytes(hash, source, source_length);
+  snprintf(path, path_size, "%s/%016llx.pl0c", cache_dir, hash);
+}
+
+// Fill the code array and symbol table from the --cache entry for the loaded source, returning 0 if there isn't one
+int lookup_cache()
+{
+  char path[4096], prefix[256];
+  cache_entry(path, sizeof(path), prefix, sizeof(prefix));
+  size_t prefix_length = strlen(prefix);
+
+  // An entry is the prefix, the source, then the binary object with the code and symbol table
+  int hit = 0;
+  FILE *file = fopen(path, "rb");
+  struct stat info;
+  if (file != NULL && fstat(fileno(file), &info) == 0 && (size_t)info.st_size > prefix_length + source_length)
+  {
+    char *entry = malloc(info.st_size);
+    size_t object_start = prefix_length + source_length;
+    hit = fread(entry, 1, info.st_size, file) == (size_t)info.st_size &&
+          memcmp(entry, prefix, prefix_length) == 0 &&
+          memcmp(entry + prefix_length, source, source_length) == 0 &&
+          load_object(entry + object_start, info.st_size - object_start);
+    free(entry);
+  }
+  if (file != NULL)
+    fclose(file);
+
+  if (hit)
+  {
+    utime(path, NULL); // Mark the entry as recently used, so trim_cache keeps it longer
+    __atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+  }
+  else
+    __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED); // load_object checks the whole object before loading any
+  return hit;
+}
+
+// Write the code array and symbol table to the --cache entry for the loaded source. The entry is written to a file of
+// its own first and then renamed into place, so a compilation running at the same time either finds the whole entry
+// or none of it. A cache that can't be written is only skipped
+void store_cache()
 {
-  int i;
-  for (i = 0; i < MAX_SYMBOL_TABLE_SIZE; i++)
+  char path[4096], prefix[256], temporary[4200];
+  cache_entry(path, sizeof(path), prefix, sizeof(prefix));
+  snprintf(temporary, sizeof(temporary), "%s.%d.%lx.tmp", path, (int)getpid(), (unsigned long)pthread_self());
+  mkdir(cache_dir, 0777);
+
+  FILE *file = fopen(temporary, "wb");
+  if (file == NULL)
+    return;
+  size_t start = output_size;
+  append_object(1);
+  size_t object_size = output_size - start;
+  int ok = fwrite(prefix, 1, strlen(prefix), file) == strlen(prefix) &&
+           fwrite(source, 1, source_length, file) == source_length &&
+           fwrite(output_buffer + start, 1, object_size, file) == object_size;
+  output_size = start;
+
+  if (fclose(file) == 0 && ok && rename(temporary, path) == 0)
+    trim_cache();
+  else
+    remove(temporary);
+}
+
+// Remove the least recently used --cache entries until the directory holds no more than --cache-size megabytes
+void trim_cache()
+{
+  DIR *dir = cache_megabytes > 0 ? opendir(cache_dir) : NULL; // 0 for no limit
+  if (dir == NULL)
+    return;
+  cache_file *files = NULL;
+  int num_files = 0, capacity = 0;
+  long long total = 0;
+  struct dirent *item;
+  while ((item = readdir(dir)) != NULL)
   {
-    if (strcmp(string, symbol_table[i].name) == 0)
+    size_t length = strlen(item->d_name);
+    char path[4096];
+    struct stat info;
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, item->d_name);
+    if (length < 5 || length >= sizeof(files->name) || strcmp(item->d_name + length - 5, ".pl0c") != 0 ||
+        stat(path, &info) != 0)
+      continue;
+    if (num_files == capacity)
     {
-      return i;
+      capacity = capacity ? capacity * 2 : 64;
+      files = realloc(files, sizeof(cache_file) * capacity);
     }
+    strcpy(files[num_files].name, item->d_name);
+    files[num_files].size = info.st_size;
+    files[num_files].used = info.st_mtim.tv_sec + info.st_mtim.tv_nsec / 1e9;
+    total += info.st_size;
+    num_files++;
   }
-  return -1;
+  closedir(dir);
+
+  long long limit = (long long)cache_megabytes << 20;
+  if (total > limit)
+  {
+    qsort(files, num_files, sizeof(cache_file), compare_cache_files);
+    for (int i = 0; i < num_files && total > limit; i++)
+    {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s/%s", cache_dir, files[i].name);
+      if (remove(path) == 0) // Another compilation may have removed it already
+        total -= files[i].size;
+    }
+  }
+  free(files);
 }
 
-// Add a symbol to the symbol table
-void add_symbol(int kind, char *name, int val, int level, int addr, int mark)
+// Order cache files from least to most recently used
+int compare_cache_files(const void *x, const void *y)
 {
-  symbol_table[tx].kind = kind;
-  strcpy(symbol_table[tx].name, name);
-  symbol_table[tx].val = val;
-  symbol_table[tx].level = level;
-  symbol_table[tx].addr = addr;
-  symbol_table[tx].mark = mark;
-  tx++;
+  const cache_file *a = x, *b = y;
+  return (a->used > b->used) - (a->used < b->used);
+}
+
+// Continue a 64-bit FNV-1a hash over more bytes
+unsigned long long hash_bytes(unsigned long long hash, const char *bytes, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char)bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Get a monotonic wall clock time in seconds
+double now_seconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Measure how long a pair of now_seconds calls takes, for pull_token to leave out of the scanner's time
+void measure_clock_overhead()
+{
+  double start = now_seconds();
+  for (int i = 0; i < 1000; i++)
+    now_seconds();
+  clock_overhead = (now_seconds() - start) / 1000;
+}
+
+// Get the time for --stats to measure a phase from, or 0 without it so compiling doesn't pay for the clock
+double stats_clock()
+{
+  return show_stats ? now_seconds() : 0;
+}
+
+// Print statistics to stderr
+void print_stats()
+{
+  if (stats_json)
+  {
+    print_stats_json();
+    return;
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(stderr, "Statistics:\n");
+  fprintf(stderr, "  read time: %.6f s\n", read_seconds);
+  fprintf(stderr, "  lex time: %.6f s\n", lex_seconds);
+  fprintf(stderr, "  parse/codegen time: %.6f s\n", parse_seconds);
+  fprintf(stderr, "  optimize time: %.6f s\n", optimize_seconds);
+  fprintf(stderr, "  output time: %.6f s\n", output_seconds);
+  fprintf(stderr, "  bytes read: %zu\n", source_length);
+  fprintf(stderr, "  tokens scanned: %lld\n", tokens_scanned);
+  fprintf(stderr, "  symbol lookups: %lld, entries compared: %lld\n", symbol_lookups, symbols_compared);
+  fprintf(stderr, "  identifier names compared: %lld\n", names_compared);
+  fprintf(stderr, "  instructions generated: %lld\n", instructions_generated);
+  fprintf(stderr, "  instructions emitted: %d\n", cx);
+  fprintf(stderr, "  constant operations folded: %d\n", folded_operations);
+  if (cache_dir != NULL)
+    fprintf(stderr, "  cache: %d hits, %d misses\n", cache_hits, cache_misses);
+  if (hoist_invariants_enabled)
+    fprintf(stderr, "  loop invariant expressions hoisted: %d, temporaries: %d\n", hoisted_expressions,
+            num_temporaries);
+  if (common_subexprs_enabled)
+    fprintf(stderr, "  common subexpressions reused: %d, operations removed: %d\n", common_subexpressions,
+            common_operations_removed);
+  if (dead_stores_enabled)
+    fprintf(stderr, "  dead stores removed: %d, %d instructions\n", dead_stores_removed,
+            dead_store_instructions_removed);
+  if (constant_loads_enabled)
+    fprintf(stderr, "  loads replaced by constants: %d\n", constant_loads_replaced);
+  if (remove_dead)
+    fprintf(stderr, "  dead code removed: %d blocks, %d instructions\n", dead_blocks_removed,
+            dead_instructions_removed);
+  for (int i = 0; i < NUM_PEEPHOLE_RULES; i++)
+  {
+    if (peephole_rules[i].enabled)
+      fprintf(stderr, "  peephole %s: applied %d times, removed %d instructions\n", peephole_rules[i].name,
+              peephole_rules[i].applied, peephole_rules[i].removed);
+  }
+  if (run_program && jit_size > 0)
+  {
+    fprintf(stderr, "  JIT native code: %d bytes\n", jit_size);
+    fprintf(stderr, "  JIT time: %.6f s\n", vm_seconds);
+  }
+  else if (run_program)
+  {
+    fprintf(stderr, "  VM instructions executed: %lld\n", vm_executed);
+    fprintf(stderr, "  VM time: %.6f s\n", vm_seconds);
+    if (vm_seconds > 0)
+      fprintf(stderr, "  VM speed: %.0f instructions/s\n", vm_executed / vm_seconds);
+  }
+  fprintf(stderr, "  bytes written: %lld\n", bytes_written);
+  fprintf(stderr, "  peak RSS: %ld KB\n", usage.ru_maxrss);
+}
+
+// Print every statistic to stderr as one JSON object on a line, with the same keys whatever the options, so runs of
+// different builds can be compared
+void print_stats_json()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(stderr, "{\"seconds\": {\"read\": %.6f, \"lex\": %.6f, \"parse_codegen\": %.6f, \"optimize\": %.6f, "
+                  "\"output\": %.6f, \"run\": %.6f}, ",
+          read_seconds, lex_seconds, parse_seconds, optimize_seconds, output_seconds, vm_seconds);
+  fprintf(stderr, "\"bytes_read\": %zu, \"tokens_scanned\": %lld, \"symbol_lookups\": %lld, \"symbols_compared\": %lld, "
+                  "\"names_compared\": %lld, ",
+          source_length, tokens_scanned, symbol_lookups, symbols_compared, names_compared);
+  fprintf(stderr, "\"instructions_generated\": %lld, \"instructions_emitted\": %d, \"bytes_written\": %lld, "
+                  "\"peak_rss_kb\": %ld, ",
+          instructions_generated, cx, bytes_written, usage.ru_maxrss);
+  fprintf(stderr, "\"constant_operations_folded\": %d, \"loop_invariants_hoisted\": %d, \"temporaries\": %d, "
+                  "\"common_subexpressions\": %d, \"common_operations_removed\": %d, ",
+          folded_operations, hoisted_expressions, num_temporaries, common_subexpressions, common_operations_removed);
+  fprintf(stderr, "\"dead_stores_removed\": %d, \"dead_store_instructions_removed\": %d, "
+                  "\"constant_loads_replaced\": %d, \"dead_blocks_removed\": %d, \"dead_instructions_removed\": %d, ",
+          dead_stores_removed, dead_store_instructions_removed, constant_loads_replaced, dead_blocks_removed,
+          dead_instructions_removed);
+  fprintf(stderr, "\"peephole\": {");
+  for (int i = 0; i < NUM_PEEPHOLE_RULES; i++)
+    fprintf(stderr, "%s\"%s\": {\"enabled\": %d, \"applied\": %d, \"removed\": %d}", i > 0 ? ", " : "",
+            peephole_rules[i].name, peephole_enabled && peephole_rules[i].enabled, peephole_rules[i].applied,
+            peephole_rules[i].removed);
+  fprintf(stderr, "}, \"cache_hits\": %d, \"cache_misses\": %d, \"vm_instructions_executed\": %lld, "
+                  "\"jit_bytes\": %d}\n",
+          cache_hits, cache_misses, vm_executed, jit_size);
+}
+
+// VM stuff
+
+// Instruction decoded for the VM's dispatch loop
+typedef struct
+{
+  void *handler; // Address of the code in run_vm that executes this instruction
+  int l;         // L
+  int m;         // M, converted from a code address to an index into the decoded program for jumps and calls
+} vm_op;
+
+// Execute a program with threaded dispatch, returning 0 if it halts normally and 1 on a runtime error
+int run_vm(const instruction *program, int length)
+{
+  // Handlers for OPR, indexed by M
+  static void *const opr_handlers[] = {&&opr_rtn, &&opr_add, &&opr_sub, &&opr_mul, &&opr_div, &&opr_eql,
+                                       &&opr_neq, &&opr_lss, &&opr_leq, &&opr_gtr, &&opr_geq, &&opr_odd};
+
+  // Handlers for the fused compare-and-branch instructions, indexed by op - 10
+  static void *const branch_handlers[] = {&&jne, &&jeq, &&jge, &&jgt, &&jle, &&jlt, &&jev};
+
+  // Decode every instruction to its handler once so the loop never switches on opcodes. Code addresses are
+  // instruction indexes times 3; any that don't name an instruction go to the extra op at the end
+  vm_op *ops = malloc(sizeof(vm_op) * (length + 1));
+  for (int i = 0; i < length; i++)
+  {
+    int op = program[i].op, m = program[i].m;
+    ops[i].l = program[i].l;
+    ops[i].m = m;
+    switch (op)
+    {
+    case 1:
+      ops[i].handler = &&lit;
+      break;
+    case 2:
+      ops[i].handler = m >= 0 && m <= 11 ? opr_handlers[m] : &&bad_instruction;
+      break;
+    case 3:
+      ops[i].handler = &&lod;
+      break;
+    case 4:
+      ops[i].handler = &&sto;
+      break;
+    case 6:
+      ops[i].handler = &&inc;
+      break;
+    case 9:
+      ops[i].handler = m == 1 ? &&sys_write : m == 2 ? &&sys_read : m == 3 ? &&sys_halt : &&bad_instruction;
+      break;
+    case 5:
+    case 7:
+    case 8:
+    case 10 ... 16:
+      ops[i].handler = op == 5 ? &&cal : op == 7 ? &&jmp : op == 8 ? &&jpc : branch_handlers[op - 10];
+      ops[i].m = m >= 0 && m % 3 == 0 && m / 3 < length ? m / 3 : length;
+      break;
+    default:
+      ops[i].handler = &&bad_instruction;
+    }
+  }
+  ops[length].handler = &&bad_address;
+
+  int *stack = calloc(VM_STACK_SIZE, sizeof(int));
+  int sp = -1; // Index of the top of the stack
+  int bp = 0;  // Index of the current activation record
+  int status = 0;
+  long long executed = 0;
+  vm_op *ip = ops;
+  int a, b, addr;
+
+// Run the handler of the instruction at ip
+#define VM_DISPATCH()  \
+  do                   \
+  {                    \
+    executed++;        \
+    goto *ip->handler; \
+  } while (0)
+
+// Go to a runtime error unless there is room to push count values
+#define VM_NEED_ROOM(count)          \
+  if (sp + (count) >= VM_STACK_SIZE) \
+  goto stack_overflow
+
+// Go to a runtime error unless the stack holds at least count values
+#define VM_NEED_VALUES(count) \
+  if (sp - (count) + 1 < 0)   \
+  goto stack_underflow
+
+// Pop the two operands of a binary OPR, leaving a as the left operand and b as the right
+#define VM_POP_OPERANDS() \
+  VM_NEED_VALUES(2);      \
+  b = stack[sp--];        \
+  a = stack[sp]
+
+// Pop the two operands of a fused branch and jump to its target unless the comparison holds
+#define VM_BRANCH_UNLESS(comparison)        \
+  VM_NEED_VALUES(2);                        \
+  b = stack[sp--];                          \
+  a = stack[sp--];                          \
+  ip = (comparison) ? ip + 1 : ops + ip->m; \
+  VM_DISPATCH()
+
+  VM_DISPATCH();
+
+lit:
+  VM_NEED_ROOM(1);
+  stack[++sp] = ip->m;
+  ip++;
+  VM_DISPATCH();
+
+lod:
+  VM_NEED_ROOM(1);
+  addr = vm_base(stack, bp, ip->l) + ip->m;
+  if (addr < 0 || addr >= VM_STACK_SIZE)
+    goto bad_address;
+  stack[sp + 1] = stack[addr];
+  sp++;
+  ip++;
+  VM_DISPATCH();
+
+sto:
+  VM_NEED_VALUES(1);
+  addr = vm_base(stack, bp, ip->l) + ip->m;
+  if (addr < 0 || addr >= VM_STACK_SIZE)
+    goto bad_address;
+  stack[addr] = stack[sp--];
+  ip++;
+  VM_DISPATCH();
+
+cal:
+  VM_NEED_ROOM(3);
+  stack[sp + 1] = vm_base(stack, bp, ip->l); // Static link
+  stack[sp + 2] = bp;                        // Dynamic link
+  stack[sp + 3] = (ip - ops + 1) * 3;        // Return address
+  bp = sp + 1;
+  ip = ops + ip->m;
+  VM_DISPATCH();
+
+inc:
+  if (sp + ip->m >= VM_STACK_SIZE)
+    goto stack_overflow;
+  if (sp + ip->m < -1)
+    goto stack_underflow;
+  sp += ip->m;
+  ip++;
+  VM_DISPATCH();
+
+jmp:
+  ip = ops + ip->m;
+  VM_DISPATCH();
+
+jpc:
+  VM_NEED_VALUES(1);
+  if (stack[sp--] == 0)
+    ip = ops + ip->m;
+  else
+    ip++;
+  VM_DISPATCH();
+
+jne:
+  VM_BRANCH_UNLESS(a == b);
+
+jeq:
+  VM_BRANCH_UNLESS(a != b);
+
+jge:
+  VM_BRANCH_UNLESS(a < b);
+
+jgt:
+  VM_BRANCH_UNLESS(a <= b);
+
+jle:
+  VM_BRANCH_UNLESS(a > b);
+
+jlt:
+  VM_BRANCH_UNLESS(a >= b);
+
+jev:
+  VM_NEED_VALUES(1);
+  if (stack[sp--] & 1)
+    ip++;
+  else
+    ip = ops + ip->m;
+  VM_DISPATCH();
+
+sys_write:
+  VM_NEED_VALUES(1);
+  vm_write(stack[sp--]);
+  ip++;
+  VM_DISPATCH();
+
+sys_read:
+  VM_NEED_ROOM(1);
+  if (!vm_read(&stack[sp + 1]))
+  {
+    fprintf(stderr, "Runtime error: could not read an integer\n");
+    goto fail;
+  }
+  sp++;
+  ip++;
+  VM_DISPATCH();
+
+opr_rtn:
+  if (bp < 0 || bp + 2 >= VM_STACK_SIZE)
+    goto bad_address;
+  sp = bp - 1;
+  addr = stack[sp + 3];
+  bp = stack[sp + 2];
+  ip = ops + (addr >= 0 && addr % 3 == 0 && addr / 3 < length ? addr / 3 : length);
+  VM_DISPATCH();
+
+// Arithmetic wraps around on overflow like the machine's own integers
+opr_add:
+  VM_POP_OPERANDS();
+  stack[sp] = (int)((unsigned int)a + (unsigned int)b);
+  ip++;
+  VM_DISPATCH();
+
+opr_sub:
+  VM_POP_OPERANDS();
+  stack[sp] = (int)((unsigned int)a - (unsigned int)b);
+  ip++;
+  VM_DISPATCH();
+
+opr_mul:
+  VM_POP_OPERANDS();
+  stack[sp] = (int)((unsigned int)a * (unsigned int)b);
+  ip++;
+  VM_DISPATCH();
+
+opr_div:
+  VM_POP_OPERANDS();
+  if (b == 0)
+  {
+    fprintf(stderr, "Runtime error: division by zero\n");
+    goto fail;
+  }
+  stack[sp] = b == -1 ? (int)(0u - (unsigned int)a) : a / b; // Truncates toward zero
+  ip++;
+  VM_DISPATCH();
+
+opr_eql:
+  VM_POP_OPERANDS();
+  stack[sp] = a == b;
+  ip++;
+  VM_DISPATCH();
+
+opr_neq:
+  VM_POP_OPERANDS();
+  stack[sp] = a != b;
+  ip++;
+  VM_DISPATCH();
+
+opr_lss:
+  VM_POP_OPERANDS();
+  stack[sp] = a < b;
+  ip++;
+  VM_DISPATCH();
+
+opr_leq:
+  VM_POP_OPERANDS();
+  stack[sp] = a <= b;
+  ip++;
+  VM_DISPATCH();
+
+opr_gtr:
+  VM_POP_OPERANDS();
+  stack[sp] = a > b;
+  ip++;
+  VM_DISPATCH();
+
+opr_geq:
+  VM_POP_OPERANDS();
+  stack[sp] = a >= b;
+  ip++;
+  VM_DISPATCH();
+
+opr_odd:
+  VM_NEED_VALUES(1);
+  stack[sp] = stack[sp] & 1;
+  ip++;
+  VM_DISPATCH();
+
+stack_overflow:
+  fprintf(stderr, "Runtime error: stack overflow at line %d\n", (int)(ip - ops));
+  goto fail;
+
+stack_underflow:
+  fprintf(stderr, "Runtime error: stack underflow at line %d\n", (int)(ip - ops));
+  goto fail;
+
+bad_instruction:
+  fprintf(stderr, "Runtime error: invalid instruction at line %d\n", (int)(ip - ops));
+  goto fail;
+
+bad_address:
+  fprintf(stderr, "Runtime error: invalid address at line %d\n", (int)(ip - ops));
+  goto fail;
+
+fail:
+  status = 1;
+
+sys_halt:
+#undef VM_DISPATCH
+#undef VM_NEED_ROOM
+#undef VM_NEED_VALUES
+#undef VM_POP_OPERANDS
+#undef VM_BRANCH_UNLESS
+  fflush(stdout);
+  vm_executed = executed;
+  free(stack);
+  free(ops);
+  return status;
+}
+
+// Find the base of the activation record l static levels down from the one at bp
+int vm_base(const int *stack, int bp, int l)
+{
+  int base = bp;
+  while (l > 0 && base >= 0 && base < VM_STACK_SIZE)
+  {
+    base = stack[base];
+    l--;
+  }
+  return base;
 }
 
-// Parse the program
-void program()
+// Read an integer for SYS 0 2 from stdin, returning 0 if there isn't one
+int vm_read(int *value)
 {
-  get_next_token();                           // Get first token
-  block();                                    // Parse block
-  if (atoi(current_token.value) != periodsym) // Check if program ends with a period
-  {
-    error(1); // Error if it doesn't
-  }
-  emit(9, 0, 3); // Emit halt instruction
+  return scanf("%d", value) == 1;
 }
 
-void block()
+// Write an integer for SYS 0 1 to stdout
+void vm_write(int value)
 {
-  const_declaration();              // Parse constants
-  int num_vars = var_declaration(); // Parse variables
-  emit(6, 0, 3 + num_vars);         // Emit INC instruction
-  statement();                      // Parse statement
+  printf("%d\n", value);
 }
 
-// Parse constants
-void const_declaration()
+// JIT stuff
+
+#if defined(__x86_64__) && defined(__linux__)
+
+// Translate a program to x86-64 machine code and run it, returning 0 if it halts normally, 1 on a runtime error, and
+// -1 without running anything if the code does something the translation doesn't handle, so it must be interpreted.
+// Values on the stack are kept in the same stack array the VM uses, at the index the VM would keep them, except the
+// top value, which is kept in eax. rbx holds the stack array's address
+int run_jit(const instruction *program, int length)
 {
-  char name[MAX_IDENTIFIER_LENGTH + 1]; // Track name of constant
-  // Check if current token is a const
-  if (atoi(current_token.value) == constsym)
+  int *depth = malloc(sizeof(int) * (length + 1));
+  char *target = calloc(length + 1, 1);
+  int frame = jit_check(program, length, depth, target);
+  if (frame < 0)
   {
-    do
+    free(depth);
+    free(target);
+    return -1;
+  }
+
+  jit_buffer buffer = {0};
+  int *labels = malloc(sizeof(int) * length);
+  int *jumps = NULL; // Offset of each rel32 to patch and the index of the instruction it jumps to, 2 ints each
+  int num_jumps = 0, jump_capacity = 0;
+
+  jit_bytes(&buffer, 4, 0x53, 0x48, 0x89, 0xFB); // push rbx, which also aligns the stack for calls; mov rbx, rdi
+  for (int i = 0; i < length; i++)
+  {
+    labels[i] = buffer.size;
+    if (depth[i] < 0)
+      continue; // Never runs
+    int op = program[i].op, m = program[i].m;
+    int values = depth[i] - frame; // Num of values above the variables, the top one in eax
+
+    // A LIT or LOD whose value is used right away by the next instruction goes straight to ecx instead of the stack
+    int operand = 0;
+    if ((op == 1 || op == 3) && i + 1 < length && !target[i + 1])
     {
-      get_next_token();
-      if (atoi(current_token.value) != identsym) // Check if next token is an identifier
+      int next = program[i + 1].op, next_m = program[i + 1].m;
+      if ((next == 2 && next_m >= 1 && next_m <= 10 && values >= 1) || (next >= 10 && next <= 15 && values >= 1) ||
+          next == 4)
       {
-        error(2); // Error if it isn't
+        if (op == 1)
+          jit_bytes(&buffer, 1, 0xB9); // mov ecx, imm32
+        else
+          jit_bytes(&buffer, 2, 0x8B, 0x8B); // mov ecx, [rbx + disp32]
+        jit_int(&buffer, op == 1 ? m : 4 * m);
+        labels[++i] = buffer.size;
+        op = next;
+        m = next_m;
+        values = depth[i] - frame;
+        operand = 1;
       }
-      strcpy(name, current_token.lexeme);                 // Save name of constant
-      if (check_symbol_table(current_token.lexeme) != -1) // Check if constant has already been declared
+    }
+
+    switch (op)
+    {
+    case 1: // LIT
+    case 3: // LOD
+      if (values >= 1)
+        jit_spill(&buffer, depth[i] - 1);
+      if (op == 1)
+        jit_bytes(&buffer, 1, 0xB8); // mov eax, imm32
+      else
+        jit_bytes(&buffer, 2, 0x8B, 0x83); // mov eax, [rbx + disp32]
+      jit_int(&buffer, op == 1 ? m : 4 * m);
+      break;
+    case 4: // STO
+      if (operand)
       {
-        error(3); // Error if it has
+        jit_bytes(&buffer, 2, 0x89, 0x8B); // mov [rbx + disp32], ecx
+        jit_int(&buffer, 4 * m);
       }
-      get_next_token();
-      if (atoi(current_token.value) != eqsym) // Check if next token is an equals sign
+      else
       {
-        error(4); // Error if it isn't
+        jit_bytes(&buffer, 2, 0x89, 0x83); // mov [rbx + disp32], eax
+        jit_int(&buffer, 4 * m);
+        jit_reload(&buffer, values - 1, depth[i] - 2);
       }
-      get_next_token();
-      if (atoi(current_token.value) != numbersym) // Check if next token is a number
+      break;
+    case 2: // OPR
+      if (m == 11)
       {
-        error(5); // Error if it isn't
+        jit_bytes(&buffer, 3, 0x83, 0xE0, 0x01); // and eax, 1
+        break;
       }
-      add_symbol(1, name, atoi(current_token.lexeme), level, 0, 0); // Add constant to symbol table
-      get_next_token();
-    } while (atoi(current_token.value) == commasym); // Continue parsing constants if next token is a comma
-    if (atoi(current_token.value) != semicolonsym)   // Check if next token is a semicolon
+      if (!operand)
+      {
+        jit_bytes(&buffer, 2, 0x89, 0xC1); // mov ecx, eax
+        jit_bytes(&buffer, 2, 0x8B, 0x83); // mov eax, [rbx + disp32]
+        jit_int(&buffer, 4 * (depth[i] - 2));
+      }
+      if (m == 1)
+        jit_bytes(&buffer, 2, 0x01, 0xC8); // add eax, ecx
+      else if (m == 2)
+        jit_bytes(&buffer, 2, 0x29, 0xC8); // sub eax, ecx
+      else if (m == 3)
+        jit_bytes(&buffer, 3, 0x0F, 0xAF, 0xC1); // imul eax, ecx
+      else if (m == 4)
+      {
+        jit_bytes(&buffer, 4, 0x85, 0xC9, 0x0F, 0x84); // test ecx, ecx; jz division_by_zero
+        jit_jump(&buffer, &jumps, &num_jumps, &jump_capacity, length);
+        // cmp ecx, -1; jne +4; neg eax; jmp +3; cdq; idiv ecx. Dividing by -1 negates, which idiv can't do for INT_MIN
+        jit_bytes(&buffer, 12, 0x83, 0xF9, 0xFF, 0x75, 0x04, 0xF7, 0xD8, 0xEB, 0x03, 0x99, 0xF7, 0xF9);
+      }
+      else
+      {
+        // cmp eax, ecx; setcc al; movzx eax, al, with the setcc for EQL NEQ LSS LEQ GTR GEQ
+        static const unsigned char setcc[] = {0x94, 0x95, 0x9C, 0x9E, 0x9F, 0x9D};
+        jit_bytes(&buffer, 8, 0x39, 0xC8, 0x0F, setcc[m - 5], 0xC0, 0x0F, 0xB6, 0xC0);
+      }
+      break;
+    case 6: // INC, only at the start so the stack array already holds the zeroed variables
+      break;
+    case 7: // JMP
+      jit_bytes(&buffer, 1, 0xE9);
+      jit_jump(&buffer, &jumps, &num_jumps, &jump_capacity, m / 3);
+      break;
+    case 8:  // JPC
+    case 16: // JEV
+      if (op == 8)
+        jit_bytes(&buffer, 2, 0x85, 0xC0); // test eax, eax
+      else
+        jit_bytes(&buffer, 2, 0xA8, 0x01); // test al, 1
+      jit_reload(&buffer, values - 1, depth[i] - 2);
+      jit_bytes(&buffer, 2, 0x0F, 0x84); // jz rel32
+      jit_jump(&buffer, &jumps, &num_jumps, &jump_capacity, m / 3);
+      break;
+    case 10 ... 15: // JNE JEQ JGE JGT JLE JLT, each jumping when its comparison is false
     {
-      error(6); // Error if it isn't
+      static const unsigned char jcc[] = {0x85, 0x84, 0x8D, 0x8F, 0x8E, 0x8C};
+      if (!operand)
+      {
+        jit_bytes(&buffer, 2, 0x89, 0xC1); // mov ecx, eax
+        jit_bytes(&buffer, 2, 0x8B, 0x83); // mov eax, [rbx + disp32]
+        jit_int(&buffer, 4 * (depth[i] - 2));
+      }
+      jit_bytes(&buffer, 2, 0x39, 0xC8); // cmp eax, ecx
+      jit_reload(&buffer, values - 2, depth[i] - 3);
+      jit_bytes(&buffer, 2, 0x0F, jcc[op - 10]);
+      jit_jump(&buffer, &jumps, &num_jumps, &jump_capacity, m / 3);
+      break;
     }
-    get_next_token();
-  }
-}
-
-// Parse variables
-int var_declaration()
-{
-  int num_vars = 0;                        // Track number of variables
-  if (atoi(current_token.value) == varsym) // Check if current token is a var
-  {
-    do
-    {
-      num_vars++; // Increment number of variables
-      get_next_token();
-      if (atoi(current_token.value) != identsym) // Check if next token is an identifier
+    case 9: // SYS
+      if (m == 1)
       {
-        error(2);
+        jit_bytes(&buffer, 2, 0x89, 0xC7); // mov edi, eax
+        jit_call(&buffer, (void *)vm_write);
+        jit_reload(&buffer, values - 1, depth[i] - 2);
       }
-      if (check_symbol_table(current_token.lexeme) != -1) // Check if variable has already been declared
+      else if (m == 2)
       {
-        error(3); // Error if it has
+        if (values >= 1)
+          jit_spill(&buffer, depth[i] - 1);
+        jit_bytes(&buffer, 3, 0x48, 0x8D, 0xBB); // lea rdi, [rbx + disp32]
+        jit_int(&buffer, 4 * depth[i]);
+        jit_call(&buffer, (void *)vm_read);
+        jit_bytes(&buffer, 4, 0x85, 0xC0, 0x0F, 0x84); // test eax, eax; jz read_failed
+        jit_jump(&buffer, &jumps, &num_jumps, &jump_capacity, length + 1);
+        jit_bytes(&buffer, 2, 0x8B, 0x83); // mov eax, [rbx + disp32]
+        jit_int(&buffer, 4 * depth[i]);
       }
-      add_symbol(2, current_token.lexeme, 0, 0, num_vars + 2, 0); // Add variable to symbol table
-      get_next_token();
-    } while (atoi(current_token.value) == commasym); // Continue parsing variables if next token is a comma
-    if (atoi(current_token.value) != semicolonsym)   // Check if next token is a semicolon
-    {
-      error(6); // Error if it isn't
+      else
+      {
+        jit_bytes(&buffer, 3, 0x31, 0xC0, 0xE9); // xor eax, eax; jmp done
+        jit_jump(&buffer, &jumps, &num_jumps, &jump_capacity, length + 2);
+      }
+      break;
     }
-    get_next_token();
   }
-  return num_vars; // Return number of variables
-}
 
-// Parse statements
-void statement()
-{
-  if (atoi(current_token.value) == identsym) // Check if current token is an identifier
-  {
-    int sx = check_symbol_table(current_token.lexeme); // Check if identifier is in symbol table
-    if (sx == -1)
-    {
-      error(7); // Error if it isn't
-    }
-    if (symbol_table[sx].kind != 2) // Check if identifier is a variable
-    {
-      error(8); // Error if it isn't
-    }
-    get_next_token();
-    if (atoi(current_token.value) != becomessym) // Check if next token is a becomes symbol (:=)
-    {
-      error(9); // Error if it isn't
-    }
-    get_next_token();
-    expression();                      // Parse expression
-    emit(4, 0, symbol_table[sx].addr); // Emit STO instruction
-  }
-  else if (atoi(current_token.value) == beginsym) // Check if current token is a begin
-  {
-    do
-    {
-      get_next_token();
-      statement();                                       // Parse statement
-    } while (atoi(current_token.value) == semicolonsym); // Continue parsing statements if next token is a semicolon
-    if (atoi(current_token.value) != endsym)             // Check if next token is an end
-    {
-      error(10); // Error if it isn't
-    }
-    get_next_token();
-  }
-  else if (atoi(current_token.value) == ifsym) // Check if current token is an if
-  {
-    get_next_token();
-    condition(); // Parse condition
-    int jx = cx;
-    emit(8, 0, 0);                            // Emit JPC instruction
-    if (atoi(current_token.value) != thensym) // Check if next token is a then
-    {
-      error(11); // Error if it isn't
-    }
-    get_next_token();
-    statement();         // Parse statement
-    code[jx].m = cx * 3; // Set JPC instruction's M to current code index
-  }
-  else if (atoi(current_token.value) == whilesym) // Check if current token is a while
+  // Exits: division by zero returns 1, a failed read 2, and halting 0 (already in eax)
+  int exits[3];
+  exits[0] = buffer.size;
+  jit_bytes(&buffer, 7, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xEB, 0x05); // mov eax, 1; jmp done
+  exits[1] = buffer.size;
+  jit_bytes(&buffer, 5, 0xB8, 0x02, 0x00, 0x00, 0x00); // mov eax, 2
+  exits[2] = buffer.size;
+  jit_bytes(&buffer, 2, 0x5B, 0xC3); // pop rbx; ret
+
+  for (int j = 0; j < num_jumps; j++)
   {
-    get_next_token();
-    int lx = cx;
-    condition();                            // Parse condition
-    if (atoi(current_token.value) != dosym) // Check if next token is a do
-    {
-      error(12); // Error if it isn't
-    }
-    get_next_token();
-    int jx = cx;         // Save current code index to jump to
-    emit(8, 0, 0);       // Emit JPC instruction
-    statement();         // Parse statement
-    emit(7, 0, lx * 3);  // Emit JMP instruction
-    code[jx].m = cx * 3; // Set JPC instruction's M to current code index
+    int at = jumps[2 * j], to = jumps[2 * j + 1];
+    int destination = to < length ? labels[to] : exits[to - length];
+    int rel = destination - (at + 4);
+    memcpy(buffer.bytes + at, &rel, 4);
   }
-  else if (atoi(current_token.value) == readsym) // Check if current token is a read
+
+  int status = -1;
+  void *native = mmap(NULL, buffer.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (native != MAP_FAILED)
   {
-    get_next_token();
-    if (atoi(current_token.value) != identsym) // Check if current token is an identifier
-    {
-      error(2); // Error if it isn't
-    }
-    int sx = check_symbol_table(current_token.lexeme); // Check if identifier is in symbol table
-    if (sx == -1)
-    {
-      error(7); // Error if it isn't
-    }
-    if (symbol_table[sx].kind != 2) // Check if identifier is a variable
+    memcpy(native, buffer.bytes, buffer.size);
+    if (mprotect(native, buffer.size, PROT_READ | PROT_EXEC) == 0)
     {
-      error(8); // Error if it isn't
+      int *stack = calloc(VM_STACK_SIZE, sizeof(int));
+      int (*entry)(int *) = (int (*)(int *))native;
+      status = entry(stack);
+      jit_size = buffer.size;
+      if (status == 1)
+        fprintf(stderr, "Runtime error: division by zero\n");
+      else if (status == 2)
+      {
+        fprintf(stderr, "Runtime error: could not read an integer\n");
+        status = 1;
+      }
+      fflush(stdout);
+      free(stack);
     }
-    get_next_token();
-    emit(9, 0, 2);  // Emit SIO instruction
-    emit(4, 0, sx); // Emit STO instruction
-  }
-  else if (atoi(current_token.value) == writesym) // Check if current token is a write
-  {
-    get_next_token();
-    expression();  // Parse expression
-    emit(9, 0, 1); // Emit SIO instruction
+    munmap(native, buffer.size);
   }
+  free(buffer.bytes);
+  free(labels);
+  free(jumps);
+  free(depth);
+  free(target);
+  return status;
 }
 
-// Parse condition
-void condition()
+// Check that the JIT can translate a program: every instruction that can run must be one it handles, with the same
+// number of values on the stack however it's reached, so the stack never overflows or underflows, and LOD and STO must
+// only use the variables the program's first INC reserves. Fills in the num of values on the stack before each
+// instruction (-1 if it never runs) and marks the instructions jumps go to. Returns the num of variables the INC
+// reserves, or -1 if the program has to be interpreted
+int jit_check(const instruction *program, int length, int *depth, char *target)
 {
-  if (atoi(current_token.value) == oddsym) // Check if current token is odd
+  // Follow the leading jumps to the INC that reserves the variables
+  int frame = -1;
+  for (int i = 0, steps = 0; i >= 0 && i < length && steps < length; steps++)
   {
-    get_next_token();
-    expression();   // Parse expression
-    emit(2, 0, 11); // Emit ODD instruction
+    if (program[i].op == 6)
+    {
+      frame = program[i].m;
+      break;
+    }
+    if (program[i].op != 7 || program[i].m % 3 != 0)
+      break;
+    i = program[i].m / 3;
   }
-  else
+  if (frame < 0 || frame >= VM_STACK_SIZE)
+    return -1;
+
+  int *work = malloc(sizeof(int) * (length + 1));
+  int num_work = 0;
+  for (int i = 0; i < length; i++)
+    depth[i] = -1;
+  depth[0] = 0;
+  work[num_work++] = 0;
+  int ok = length > 0;
+  while (ok && num_work > 0)
   {
-    expression();                      // Parse expression
-    switch (atoi(current_token.value)) // Check if current token is a comparison operator
+    int i = work[--num_work];
+    int op = program[i].op, m = program[i].m, d = depth[i];
+    int pops = 0, pushes = 0, jumps = 0, falls = 1; // Stack effect and where control goes after the instruction
+    switch (op)
     {
-    case eqsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 5); // Emit EQL instruction
+    case 1:
+      pushes = 1;
       break;
-    case neqsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 6); // Emit NEQ instruction
+    case 2:
+      pops = m == 11 ? 1 : 2;
+      pushes = 1;
+      ok = m >= 1 && m <= 11;
       break;
-    case lessym:
-      get_next_token();
-      expression();
-      emit(2, 0, 7); // Emit LSS instruction
+    case 3:
+    case 4:
+      pushes = op == 3;
+      pops = op == 4;
+      ok = program[i].l == 0 && m >= 0 && m < frame;
       break;
-    case leqsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 8); // Emit LEQ instruction
+    case 6:
+      ok = d == 0 && m == frame;
+      pushes = frame;
       break;
-    case gtrsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 9); // Emit GTR instruction
+    case 7:
+      jumps = 1;
+      falls = 0;
       break;
-    case geqsym:
-      get_next_token();
-      expression();
-      emit(2, 0, 10); // Emit GEQ instruction
+    case 8:
+    case 16:
+      pops = 1;
+      jumps = 1;
       break;
-    default:
-      error(13); // Error if it isn't
+    case 10 ... 15:
+      pops = 2;
+      jumps = 1;
+      break;
+    case 9:
+      pops = m == 1;
+      pushes = m == 2;
+      falls = m != 3;
+      ok = m >= 1 && m <= 3;
       break;
+    default:
+      ok = 0; // CAL, RTN and invalid instructions
     }
-  }
-}
 
-// Parse expression
-void expression()
-{
-  term(); // Parse term
-  // Check if current token is a plus or minus
-  while (atoi(current_token.value) == plussym || atoi(current_token.value) == minussym)
-  {
-    if (atoi(current_token.value) == plussym) // Check if current token is a plus
-    {
-      get_next_token();
-      term();
-      emit(2, 0, 1); // Emit ADD instruction
-    }
-    else
+    // Values may only be pushed and popped above the variables, so only jumps and halting can come before the INC
+    if (op != 6 && op != 7 && !(op == 9 && m == 3) && d - pops < frame)
+      ok = 0;
+    int after = d - pops + pushes;
+    if (after >= VM_STACK_SIZE)
+      ok = 0;
+
+    int next[2], num_next = 0;
+    if (jumps)
     {
-      get_next_token();
-      term();
-      emit(2, 0, 2); // Emit SUB instruction
+      ok = ok && m >= 0 && m % 3 == 0 && m / 3 < length;
+      next[num_next++] = m / 3;
+      if (ok)
+        target[m / 3] = 1;
     }
-  }
-}
-
-// Parse term
-void term()
-{
-  factor(); // Parse factor
-  while (atoi(current_token.value) == multsym || atoi(current_token.value) == slashsym)
-  {
-    if (atoi(current_token.value) == multsym) // Check if current token is a multiply
+    if (falls)
     {
-      get_next_token();
-      factor();      // Parse factor
-      emit(2, 0, 3); // Emit MUL
+      ok = ok && i + 1 < length;
+      next[num_next++] = i + 1;
     }
-    else
+    for (int k = 0; ok && k < num_next; k++)
     {
-      get_next_token();
-      factor();      // Parse factor
-      emit(2, 0, 4); // Emit DIV
+      if (depth[next[k]] == -1)
+      {
+        depth[next[k]] = after;
+        work[num_work++] = next[k];
+      }
+      else
+        ok = depth[next[k]] == after;
     }
   }
+  free(work);
+  return ok ? frame : -1;
 }
 
-// Parse factor
-void factor()
+// Append count bytes to the native code
+void jit_bytes(jit_buffer *buffer, int count, ...)
 {
-  if (atoi(current_token.value) == identsym) // Check if current token is an identifier
-  {
-    int sx = check_symbol_table(current_token.lexeme); // Check if identifier is in symbol table
-    if (sx == -1)
-    {
-      error(7); // Error if it isn't
-    }
-    if (symbol_table[sx].kind == 1) // Check if identifier is a constant
-    {
-      emit(1, 0, symbol_table[sx].val); // Emit LIT instruction
-    }
-    else
-    {
-      emit(3, level - symbol_table[sx].level, symbol_table[sx].addr); // Emit LOD instruction
-    }
-    get_next_token();
-  }
-  else if (atoi(current_token.value) == numbersym) // Check if current token is a number
-  {
-    emit(1, 0, atoi(current_token.lexeme)); // Emit LIT instruction
-    get_next_token();
-  }
-  else if (atoi(current_token.value) == lparentsym) // Check if current token is a left parenthesis
-  {
-    get_next_token();
-    expression();                                // Parse expression
-    if (atoi(current_token.value) != rparentsym) // Check if currenet token is right parenthesis
-    {
-      error(14); // Error if it isn't
-    }
-    get_next_token();
-  }
-  else
+  if (buffer->size + count > buffer->capacity)
   {
-    error(15); // Error if current token is none of the above
+    buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+    buffer->bytes = realloc(buffer->bytes, buffer->capacity);
   }
+  va_list args;
+  va_start(args, count);
+  for (int i = 0; i < count; i++)
+    buffer->bytes[buffer->size++] = va_arg(args, int);
+  va_end(args);
 }
 
-// Print symbol table
-void print_symbol_table()
+// Append a 32-bit little endian value to the native code
+void jit_int(jit_buffer *buffer, int value)
 {
-  print_both("\nSymbol Table:\n");
-  print_both("%10s | %10s | %10s | %10s | %10s | %10s\n", "Kind", "Name", "Value", "Level", "Address", "Mark", "\n");
-  print_both("    -----------------------------------------------------------------------\n");
+  jit_bytes(buffer, 4, value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF);
+}
 
-  for (int i = 0; i < tx; i++)
+// Append the rel32 of a jump to instruction to (length and up for the exits), to be patched once every instruction's
+// native address is known
+void jit_jump(jit_buffer *buffer, int **jumps, int *num_jumps, int *capacity, int to)
+{
+  if (*num_jumps == *capacity)
   {
-    symbol_table[i].mark = 1;
-    if (symbol_table[i].kind == 1)
-      print_both("%10d | %10s | %10d | %10s | %10s | %10d\n", symbol_table[i].kind, symbol_table[i].name, symbol_table[i].val, "-", "-", symbol_table[i].mark);
-    else
-
-      print_both("%10d | %10s | %10d | %10d | %10d | %10d\n", symbol_table[i].kind, symbol_table[i].name, symbol_table[i].val, symbol_table[i].level, symbol_table[i].addr, symbol_table[i].mark);
+    *capacity = *capacity ? *capacity * 2 : 64;
+    *jumps = realloc(*jumps, sizeof(int) * 2 * *capacity);
   }
+  (*jumps)[2 * *num_jumps] = buffer->size;
+  (*jumps)[2 * *num_jumps + 1] = to;
+  (*num_jumps)++;
+  jit_int(buffer, 0);
 }
 
-// Print assmebly code
-void print_instructions()
+// Store the top value from eax to its place in the stack array before something is pushed over it
+void jit_spill(jit_buffer *buffer, int index)
 {
+  jit_bytes(buffer, 2, 0x89, 0x83); // mov [rbx + disp32], eax
+  jit_int(buffer, 4 * index);
+}
 
-  print_both("Assembly Code:\n");
-  print_both("%10s %10s %10s %10s\n", "Line", "OP", "L", "M");
-  for (int i = 0; i < cx; i++)
-  {
-    char name[4];
-    get_op_name(code[i].op, name);
-    print_both("%10d %10s %10d %10d\n", i, name, code[i].l, code[i].m);
-  }
+// Load the new top value into eax after popping, if any values are left above the variables
+void jit_reload(jit_buffer *buffer, int values, int index)
+{
+  if (values < 1)
+    return;
+  jit_bytes(buffer, 2, 0x8B, 0x83); // mov eax, [rbx + disp32]
+  jit_int(buffer, 4 * index);
 }
 
-// Get op name from op code
-void get_op_name(int op, char *name)
+// Call a C function, which may change eax, ecx, edx, esi and edi but keeps rbx
+void jit_call(jit_buffer *buffer, void *function)
 {
-  switch (op)
-  {
-  case 1:
-    strcpy(name, "LIT");
-    break;
-  case 2:
-    strcpy(name, "OPR");
-    break;
-  case 3:
-    strcpy(name, "LOD");
-    break;
-  case 4:
-    strcpy(name, "STO");
-    break;
-  case 5:
-    strcpy(name, "CAL");
-    break;
-  case 6:
-    strcpy(name, "INC");
-    break;
-  case 7:
-    strcpy(name, "JMP");
-    break;
-  case 8:
-    strcpy(name, "JPC");
-    break;
-  case 9:
-    strcpy(name, "SYS");
-    break;
-  }
-}
\ No newline at end of file
+  unsigned long long address = (unsigned long long)function;
+  jit_bytes(buffer, 2, 0x48, 0xB8); // mov rax, imm64
+  for (int i = 0; i < 8; i++)
+    jit_bytes(buffer, 1, (int)(address >> (8 * i)) & 0xFF);
+  jit_bytes(buffer, 2, 0xFF, 0xD0); // call rax
+}
+
+#else
+
+// Without x86-64 Linux every program is interpreted
+int run_jit(const instruction *program, int length)
+{
+  (void)program;
+  (void)length;
+  return -1;
+}
+
+#endif
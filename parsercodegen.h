@@ -0,0 +1,64 @@
+/*
+    COP 3402 Systems Software
+    Tiny PL/0 Compiler Library
+    Authored by Caleb Rivera and Matthew Labrada
+*/
+
+#ifndef PARSERCODEGEN_H
+#define PARSERCODEGEN_H
+
+#include <stddef.h>
+
+#define PL0_LEXER_ERROR 18  // Error code when the scanner stops, after the parser's error codes 1 to 17
+#define PL0_MAX_LEXEME 32   // Size of pl0_error's lexeme, longer lexemes are cut short
+#define PL0_MAX_MESSAGE 128 // Size of pl0_error's message
+
+// Only these functions are exported from the shared library built with -fvisibility=hidden
+#define PL0_API __attribute__((visibility("default")))
+
+// Instruction of the compiled code, as printed in the listing
+typedef struct
+{
+  int op; // opcode
+  int l;  // L
+  int m;  // M
+} pl0_instruction;
+
+// Symbol table entry, as printed in the listing
+typedef struct
+{
+  int kind;      // const = 1, var = 2, proc = 3
+  char name[12]; // null terminated name
+  int val;       // number (ASCII value)
+  int level;     // L level
+  int addr;      // M address
+  int mark;      // to indicate unavailable or deleted
+} pl0_symbol;
+
+// Why a compilation stopped
+typedef struct
+{
+  int code;                      // Error code from error(), PL0_LEXER_ERROR if the scanner stopped, 0 if none
+  char lexeme[PL0_MAX_LEXEME];   // Text of the token the error was found at ("" at the end of the source)
+  char message[PL0_MAX_MESSAGE]; // Message the compiler prints for the error, without the "Error: " prefix
+} pl0_error;
+
+// Result of compiling a source buffer
+typedef struct
+{
+  pl0_instruction *code; // Compiled code (NULL if the source didn't compile)
+  int num_instructions;  // Num of instructions in code
+  pl0_symbol *symbols;   // Symbol table (NULL if the source didn't compile)
+  int num_symbols;       // Num of entries in symbols
+  pl0_error error;       // Why the compilation stopped (code 0 if it didn't)
+} pl0_result;
+
+// Compile length chars of PL/0 source into result with the default options, without reading or writing any file or
+// the console. Returns 0 on success or the error code, which is also in result->error. Safe to call from several
+// threads at once. Free the result with pl0_free_result
+PL0_API int pl0_compile(const char *source, size_t length, pl0_result *result);
+
+// Free the code and symbol table of a result filled by pl0_compile
+PL0_API void pl0_free_result(pl0_result *result);
+
+#endif
@@ -0,0 +1,469 @@
+# Generate large PL/0 programs and time the compiler on them
+# Usage: ./run_benchmarks.sh [path to compiled parsercodegen, default ./a.out]
+
+compiler=${1:-./a.out}
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+TIMEFORMAT="%R"
+
+# Time a single compile of the given input, printing the wall clock seconds
+time_compile()
+{
+    { time "$compiler" "$@" > /dev/null 2>&1; } 2>&1
+}
+
+# Parse time vs token count: "begin ;;;...; end." emits no code, so this
+# isolates the scanner and the token stream feeding the parser
+echo "Token stream: tokens -> seconds"
+for n in 1000 10000 100000 1000000
+do
+    {
+        echo "var x;"
+        echo "begin"
+        head -c $((n - 6)) /dev/zero | tr '\0' ';'
+        echo
+        echo "end."
+    } > "$workdir/tokens$n.txt"
+    echo "$n $(time_compile "$workdir/tokens$n.txt" "$workdir/out.txt")"
+done
+
+# Symbol lookups vs table size: every constant declaration looks its name up
+# in the symbol table to reject duplicates
+echo "Symbol table: constants -> seconds"
+for n in 1000 10000 100000
+do
+    {
+        printf "const c0 = 0"
+        for ((i = 1; i < n; i++))
+        do
+            printf ", c%d = %d" $i $((i % 10000))
+        done
+        echo ";"
+        echo "begin"
+        echo "end."
+    } > "$workdir/symbols$n.txt"
+    echo "$n $(time_compile "$workdir/symbols$n.txt" "$workdir/out.txt")"
+done
+
+# Symbol lookups: the table indexed by interned name against the strcmp scan of all 500 slots that
+# check_symbol_table used to do, with the same symbols in both
+if command -v "${CC:-cc}" > /dev/null && [ -f parsercodegen.c ]
+then
+    cat > "$workdir/lookups.c" <<'EOF'
+#include "parsercodegen.c"
+
+// The symbol table and lookup check_symbol_table had before it used interned names
+struct
+{
+  char name[12];
+} scanned_table[MAX_SYMBOL_TABLE_SIZE];
+
+int scan_symbol_table(const char *string)
+{
+  for (int i = 0; i < MAX_SYMBOL_TABLE_SIZE; i++)
+    if (strcmp(string, scanned_table[i].name) == 0)
+      return i;
+  return -1;
+}
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Look up each of N symbols in turn with both tables, printing millions of lookups per second for each
+int main(int argc, char *argv[])
+{
+  int n = atoi(argv[1]), ids[MAX_SYMBOL_TABLE_SIZE];
+  char names_text[MAX_SYMBOL_TABLE_SIZE][12];
+  create_compiler_state();
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(names_text[i], sizeof(names_text[i]), "s%d", i);
+    strcpy(scanned_table[i].name, names_text[i]);
+    ids[i] = intern_name(&names, names_text[i], strlen(names_text[i]));
+    add_symbol(2, ids[i], 0, 0, i + 3, 0);
+  }
+
+  volatile int found = 0;
+  int lookups = 1000000;
+  double start = now();
+  for (int i = 0; i < lookups; i++)
+    found += scan_symbol_table(names_text[i % n]);
+  double scanned = now() - start;
+  lookups *= 100;
+  start = now();
+  for (int i = 0; i < lookups; i++)
+    found += check_symbol_table(ids[i % n]);
+  double hashed = now() - start;
+  printf("%.1f %.1f\n", lookups / 100 / scanned / 1e6, lookups / hashed / 1e6);
+  return 0;
+}
+EOF
+    "${CC:-cc}" -O2 -DPL0_LIBRARY -I. -o "$workdir/lookups" "$workdir/lookups.c" -pthread
+    echo "Symbol lookups: symbols -> M lookups/s (scan of all slots), M lookups/s (interned names)"
+    for n in 10 100 490
+    do
+        echo "$n $("$workdir/lookups" $n)"
+    done
+fi
+
+# Lexer throughput: scan a keyword and operator heavy program without compiling it
+echo "Lexer: tokens -> seconds"
+for n in 100000 1000000 10000000
+do
+    {
+        echo "var alpha, beta, gamma;"
+        echo "begin"
+        for ((i = 0; i < n / 16; i++))
+        do
+            echo "  while alpha <= beta do alpha := (beta + 12) * gamma - 7; // loop"
+        done
+        echo "end."
+    } > "$workdir/lexer$n.txt"
+    echo "$n $(time_compile --lex-only "$workdir/lexer$n.txt" "$workdir/out.txt")"
+done
+
+# Stress test: compile a program of just over 1M instructions with the
+# instruction limit lifted and check every instruction made it to the listing
+echo "Code buffer: instructions -> seconds"
+{
+    echo "var x, y;"
+    echo "begin"
+    for ((i = 0; i < 250000; i++))
+    do
+        echo "x := y * 2;"
+    done
+    echo "end."
+} > "$workdir/stress.txt"
+echo "1000003 $(time_compile --max-code=0 "$workdir/stress.txt" "$workdir/stress_out.txt")"
+listed=$(grep -c -E "^ +[0-9]+ +(JMP|INC|LIT|OPR|LOD|STO|SYS)" "$workdir/stress_out.txt")
+[ "$listed" = 1000003 ] || echo "Stress test failed: listed $listed instructions"
+
+# VM throughput: compile and run a loop-heavy program in one process
+echo "VM: loop iterations -> seconds, instructions executed, instructions/s"
+for n in 1000000 10000000
+do
+    {
+        echo "var i, s;"
+        echo "begin"
+        echo "  i := 10000 * $((n / 10000));" # Numbers are limited to 5 digits
+        echo "  while i > 0 do"
+        echo "  begin"
+        echo "    s := s + i * 2;"
+        echo "    i := i - 1"
+        echo "  end;"
+        echo "  write s"
+        echo "end."
+    } > "$workdir/loop$n.txt"
+    stats=$({ time "$compiler" --quiet --run --stats "$workdir/loop$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    echo "$n $(echo "$stats" | tail -1) $(echo "$stats" | grep "VM instructions executed" | awk '{print $NF}') $(echo "$stats" | grep "VM speed" | awk '{print $3}')"
+done
+
+# Fused branches: the same loops with each comparison and its JPC compiled
+# into one branch instruction
+echo "Fused branches: loop iterations -> instructions executed, seconds (plain, then --fuse-branches)"
+for n in 1000000 10000000
+do
+    plain=$({ time "$compiler" --quiet --run --stats "$workdir/loop$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    fused=$({ time "$compiler" --quiet --run --stats --fuse-branches "$workdir/loop$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    echo "$n $(echo "$plain" | grep "VM instructions executed" | awk '{print $NF}') $(echo "$plain" | tail -1)" \
+        "$(echo "$fused" | grep "VM instructions executed" | awk '{print $NF}') $(echo "$fused" | tail -1)"
+done
+
+# Loop-invariant code motion: a loop body that recomputes values none of its
+# statements change
+echo "Hoisting invariants: loop iterations -> instructions executed, seconds (plain, then --hoist-invariants)"
+for n in 1000000 10000000
+do
+    {
+        echo "var i, s, w, h;"
+        echo "begin"
+        echo "  w := 640;"
+        echo "  h := 480;"
+        echo "  i := 10000 * $((n / 10000));"
+        echo "  while i > 0 do"
+        echo "  begin"
+        echo "    s := s + i * (w * h) - (w + h) / 2;"
+        echo "    i := i - 1"
+        echo "  end;"
+        echo "  write s"
+        echo "end."
+    } > "$workdir/invariant$n.txt"
+    plain=$({ time "$compiler" --quiet --run --stats "$workdir/invariant$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    hoisted=$({ time "$compiler" --quiet --run --stats --hoist-invariants "$workdir/invariant$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    echo "$n $(echo "$plain" | grep "VM instructions executed" | awk '{print $NF}') $(echo "$plain" | tail -1)" \
+        "$(echo "$hoisted" | grep "VM instructions executed" | awk '{print $NF}') $(echo "$hoisted" | tail -1)"
+done
+
+# Common subexpressions: a loop body that computes the same values several
+# times over
+echo "Common subexpressions: loop iterations -> instructions executed, seconds (plain, then --common-subexprs)"
+for n in 1000000 10000000
+do
+    {
+        echo "var i, s, d;"
+        echo "begin"
+        echo "  i := 10000 * $((n / 10000));"
+        echo "  while i > 0 do"
+        echo "  begin"
+        echo "    d := (i + 3) * (i + 3) - (i + 3);"
+        echo "    s := s + d / 7 + (i + 3) * 2;"
+        echo "    i := i - 1"
+        echo "  end;"
+        echo "  write s"
+        echo "end."
+    } > "$workdir/repeated$n.txt"
+    plain=$({ time "$compiler" --quiet --run --stats "$workdir/repeated$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    reused=$({ time "$compiler" --quiet --run --stats --common-subexprs "$workdir/repeated$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    echo "$n $(echo "$plain" | grep "VM instructions executed" | awk '{print $NF}') $(echo "$plain" | tail -1)" \
+        "$(echo "$reused" | grep "VM instructions executed" | awk '{print $NF}') $(echo "$reused" | tail -1)"
+done
+
+# Dataflow passes: a loop body that loads a variable only ever set to one
+# constant and stores a value overwritten before it's loaded
+echo "Dataflow passes: loop iterations -> instructions emitted, instructions executed, seconds (plain, then --dead-stores --constant-loads)"
+for n in 1000000 10000000
+do
+    {
+        echo "var i, s, k, t, u;"
+        echo "begin"
+        echo "  k := 12;"
+        echo "  i := 10000 * $((n / 10000));"
+        echo "  while i > 0 do"
+        echo "  begin"
+        echo "    t := i * k;"
+        echo "    u := k + 3;"
+        echo "    t := i + k * 2;"
+        echo "    s := s + t - u;"
+        echo "    i := i - 1"
+        echo "  end;"
+        echo "  write s"
+        echo "end."
+    } > "$workdir/dataflow$n.txt"
+    plain=$({ time "$compiler" --quiet --run --stats "$workdir/dataflow$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    passes=$({ time "$compiler" --quiet --run --stats --dead-stores --constant-loads "$workdir/dataflow$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    echo "$n $(echo "$plain" | grep -E "instructions (emitted|executed)" | awk '{printf "%s ", $NF}')$(echo "$plain" | tail -1)" \
+        "$(echo "$passes" | grep -E "instructions (emitted|executed)" | awk '{printf "%s ", $NF}')$(echo "$passes" | tail -1)"
+done
+
+# JIT: the VM loops again, run as native code
+echo "JIT: loop iterations -> seconds (interpreted, then --jit)"
+for n in 1000000 10000000
+do
+    plain=$({ time "$compiler" --quiet --run "$workdir/loop$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    native=$({ time "$compiler" --quiet --run --jit "$workdir/loop$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+    echo "$n $(echo "$plain" | tail -1) $(echo "$native" | tail -1)"
+done
+
+# Emitted C: the VM loops again, written as C and compiled natively
+if command -v "${CC:-cc}" > /dev/null
+then
+    echo "Emitted C: loop iterations -> seconds (interpreted, then --emit-c compiled with ${CC:-cc} -O2)"
+    for n in 1000000 10000000
+    do
+        "$compiler" --quiet --emit-c="$workdir/loop$n.c" "$workdir/loop$n.txt" "$workdir/out.txt"
+        "${CC:-cc}" -O2 -o "$workdir/loop$n.native" "$workdir/loop$n.c"
+        plain=$({ time "$compiler" --quiet --run "$workdir/loop$n.txt" "$workdir/out.txt" > /dev/null; } 2>&1)
+        native=$({ time "$workdir/loop$n.native" > /dev/null; } 2>&1)
+        echo "$n $(echo "$plain" | tail -1) $(echo "$native" | tail -1)"
+    done
+fi
+
+# Batch compilation: 10,000 sources made from the test and error programs,
+# one process per file as run_error_cases.sh does, then one --batch process
+echo "Batch: files -> seconds (one process per file, then --batch)"
+sources=(test*.txt error?.txt error??.txt)
+mkdir -p "$workdir/batch"
+: > "$workdir/batch/list.txt"
+for i in $(seq 0 9999)
+do
+    cp "${sources[$((i % ${#sources[@]}))]}" "$workdir/batch/in$i.txt"
+    echo "$workdir/batch/in$i.txt $workdir/batch/out$i.txt" >> "$workdir/batch/list.txt"
+done
+processes=$({ time while read -r input output; do "$compiler" --quiet "$input" "$output"; done < "$workdir/batch/list.txt"; } 2>&1)
+batched=$({ time "$compiler" --batch="$workdir/batch/list.txt" > /dev/null; } 2>&1)
+echo "10000 $(echo "$processes" | tail -1) $(echo "$batched" | tail -1)"
+
+# Library: small programs compiled in memory with pl0_compile, as a service
+# would on the request path, then one process per compile as it does today
+if command -v "${CC:-cc}" > /dev/null && [ -f parsercodegen.c ]
+then
+    cat > "$workdir/library.c" <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "parsercodegen.h"
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare(const void *x, const void *y)
+{
+    double a = *(const double *)x, b = *(const double *)y;
+    return (a > b) - (a < b);
+}
+
+// Compile a file N times, printing compiles per second and the median and 99th percentile latency in microseconds
+int main(int argc, char *argv[])
+{
+    static char source[1 << 20];
+    FILE *file = fopen(argv[1], "rb");
+    size_t length = fread(source, 1, sizeof(source), file);
+    fclose(file);
+    int n = atoi(argv[2]);
+    double *latencies = malloc(sizeof(double) * n);
+    double start = now();
+    for (int i = 0; i < n; i++)
+    {
+        double before = now();
+        pl0_result result;
+        pl0_compile(source, length, &result);
+        pl0_free_result(&result);
+        latencies[i] = now() - before;
+    }
+    double seconds = now() - start;
+    qsort(latencies, n, sizeof(double), compare);
+    printf("%.0f %.2f %.2f\n", n / seconds, latencies[n / 2] * 1e6, latencies[n * 99 / 100] * 1e6);
+    return 0;
+}
+EOF
+    "${CC:-cc}" -O2 -DPL0_LIBRARY -I. -o "$workdir/library" "$workdir/library.c" parsercodegen.c -pthread
+    echo "Library: program -> compiles/s, p50 us, p99 us (pl0_compile), then compiles/s (one process per compile)"
+    for input in test1.txt test5.txt
+    do
+        seconds=$({ time for i in $(seq 1000); do "$compiler" --quiet "$input" "$workdir/out.txt"; done; } 2>&1)
+        echo "$input $("$workdir/library" "$input" 100000) $(echo "$seconds" | tail -1 | awk '{printf "%.0f", 1000 / $1}')"
+    done
+fi
+
+# Compile server: requests for a small program sent over a Unix socket to
+# one --serve process by a load generator with 1 and 4 connections, each
+# sending its next request once the last one is answered
+if command -v "${CC:-cc}" > /dev/null
+then
+    cat > "$workdir/client.c" <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+const char *socket_path;
+char source[1 << 20];
+size_t source_length;
+int requests_per_connection;
+double *latencies;
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare(const void *x, const void *y)
+{
+    double a = *(const double *)x, b = *(const double *)y;
+    return (a > b) - (a < b);
+}
+
+// Send one connection's requests, recording the latency of each
+void *run_connection(void *arg)
+{
+    double *latency = arg;
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        perror("connect");
+        exit(1);
+    }
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(fd, "w");
+    static __thread char response[1 << 20];
+    for (int i = 0; i < requests_per_connection; i++)
+    {
+        double before = now();
+        fprintf(out, "listing %zu\n", source_length);
+        fwrite(source, 1, source_length, out);
+        fflush(out);
+        int status;
+        size_t length;
+        if (fscanf(in, "%d %zu", &status, &length) != 2 || fgetc(in) != '\n' ||
+            fread(response, 1, length, in) != length)
+        {
+            fprintf(stderr, "bad response\n");
+            exit(1);
+        }
+        latency[i] = now() - before;
+    }
+    return NULL;
+}
+
+// Usage: client SOCKET FILE REQUESTS CONNECTIONS. Prints requests per second and the median and 99th percentile
+// latency in microseconds
+int main(int argc, char *argv[])
+{
+    socket_path = argv[1];
+    FILE *file = fopen(argv[2], "rb");
+    source_length = fread(source, 1, sizeof(source), file);
+    fclose(file);
+    int connections = atoi(argv[4]);
+    requests_per_connection = atoi(argv[3]) / connections;
+    int n = requests_per_connection * connections;
+    latencies = malloc(sizeof(double) * n);
+    pthread_t threads[64];
+    double start = now();
+    for (int c = 0; c < connections; c++)
+        pthread_create(&threads[c], NULL, run_connection, latencies + c * requests_per_connection);
+    for (int c = 0; c < connections; c++)
+        pthread_join(threads[c], NULL);
+    double seconds = now() - start;
+    qsort(latencies, n, sizeof(double), compare);
+    printf("%.0f %.2f %.2f\n", n / seconds, latencies[n / 2] * 1e6, latencies[n * 99 / 100] * 1e6);
+    return 0;
+}
+EOF
+    "${CC:-cc}" -O2 -o "$workdir/client" "$workdir/client.c" -pthread
+    "$compiler" --serve="$workdir/server.sock" &
+    server=$!
+    while [ ! -S "$workdir/server.sock" ] && kill -0 "$server" 2> /dev/null
+    do
+        sleep 0.1
+    done
+    echo "Compile server: program connections -> requests/s, p50 us, p99 us"
+    for input in test1.txt test5.txt
+    do
+        for connections in 1 4
+        do
+            echo "$input $connections $("$workdir/client" "$workdir/server.sock" "$input" 100000 "$connections")"
+        done
+    done
+    kill "$server"
+fi
+
+# Compilation cache: programs from above compiled with --optimize and no
+# cache, then into an empty --cache directory, then again from the cache
+echo "Cache: program -> seconds (no cache, cache miss, cache hit)"
+for input in stress.txt symbols100000.txt
+do
+    rm -rf "$workdir/cache"
+    echo "$input $(time_compile --optimize --max-code=0 "$workdir/$input" "$workdir/out.txt")" \
+        "$(time_compile --optimize --max-code=0 --cache="$workdir/cache" "$workdir/$input" "$workdir/out.txt")" \
+        "$(time_compile --optimize --max-code=0 --cache="$workdir/cache" "$workdir/$input" "$workdir/out.txt")"
+done
+
+# Phases: where the time goes compiling the stress program, as JSON
+echo "Phases: --stats=json for stress.txt with --optimize"
+"$compiler" --quiet --optimize --max-code=0 --stats=json "$workdir/stress.txt" "$workdir/out.txt" 2>&1 > /dev/null
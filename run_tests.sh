@@ -0,0 +1,321 @@
+# Run the compiler's checks against the test programs
+# Usage: ./run_tests.sh [path to compiled parsercodegen, default ./a.out]
+
+compiler=${1:-./a.out}
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+failures=0
+
+# Report the result of one check
+check()
+{
+    if [ "$1" = 0 ]
+    then
+        echo "PASS $2"
+    else
+        echo "FAIL $2"
+        failures=$((failures + 1))
+    fi
+}
+
+# Set expression to a random expression of the variables, small numbers, and the program's shared expression, which
+# is repeated often so there are common subexpressions to find
+random_expression()
+{
+    if [ "$1" -ge 3 ] || [ $((RANDOM % 3)) = 0 ]
+    then
+        if [ $((RANDOM % 3)) = 0 ]
+        then
+            expression=$((RANDOM % 20))
+        else
+            expression=${variables[RANDOM % 4]}
+        fi
+    elif [ $((RANDOM % 4)) = 0 ]
+    then
+        expression=$shared
+    else
+        random_expression $(($1 + 1))
+        local left=$expression
+        random_expression $(($1 + 1))
+        expression="($left ${operators[RANDOM % 4]} $expression)"
+    fi
+}
+
+# Print random statements nested $1 deep. Every while loop counts its own counter down from a small number, so the
+# program always halts, and starts by adding the program's invariant expression, whose variable is never stored, so
+# there is loop invariant code to hoist
+random_statements()
+{
+    local count=$((RANDOM % 4 + 1)) i left counter=${counters[$1]}
+    for ((i = 0; i < count; i++))
+    do
+        case $((RANDOM % 6)) in
+        0)
+            if [ "$1" -lt 2 ]
+            then
+                echo "$counter := $((RANDOM % 5));"
+                echo "while $counter > 0 do begin"
+                left=${variables[RANDOM % 4]}
+                echo "$left := $left + $invariant * $counter;"
+                random_statements $(($1 + 1))
+                echo "$counter := $counter - 1 end;"
+            fi
+            ;;
+        1)
+            random_expression 1
+            left=$expression
+            random_expression 1
+            echo "if $left ${comparisons[RANDOM % 6]} $expression then begin"
+            random_statements $(($1 + 1))
+            echo "end;"
+            ;;
+        2)
+            random_expression 0
+            echo "write $expression;"
+            ;;
+        3)
+            echo "read ${variables[RANDOM % 4]};"
+            ;;
+        *)
+            random_expression 0
+            echo "${variables[RANDOM % 4]} := $expression;"
+            ;;
+        esac
+    done
+}
+
+# Print a random program for the seed $1
+random_program()
+{
+    RANDOM=$1
+    variables=(a b c d)
+    operators=(+ - '*' /)
+    comparisons=('=' '<>' '<' '<=' '>' '>=')
+    counters=(i j)
+    shared="(a + b * $((RANDOM % 10)))"
+    invariant="(e * $((RANDOM % 9 + 1)) - $((RANDOM % 20)))"
+    echo "var a, b, c, d, e, i, j;"
+    echo "begin"
+    echo "read a; read b; read e;"
+    random_statements 0
+    echo "write a; write b; write c; write d"
+    echo "end."
+}
+
+# Run the program $1 with the options after it, printing its output and exit status
+run_generated()
+{
+    local program=$1
+    shift
+    printf '3\n5\n7\n2\n9\n1\n4\n' | "$compiler" --quiet --run --max-code=0 "$@" "$program" "$workdir/generated.txt" 2>&1
+    echo "exit $?"
+}
+
+for input in test*.txt
+do
+    name=${input%.txt}
+
+    # Skip programs that don't compile, their output is just an error message
+    if ! "$compiler" --quiet --binary="$workdir/$name.bin" "$input" "$workdir/$name.txt"
+    then
+        continue
+    fi
+
+    echo "$input $workdir/$name.batch.txt" >> "$workdir/batch.list"
+
+    # The listing printed from the binary object must match the one printed while compiling
+    "$compiler" --quiet --from-binary "$workdir/$name.bin" "$workdir/$name.from_binary.txt"
+    cmp -s "$workdir/$name.txt" "$workdir/$name.from_binary.txt"
+    check $? "binary round trip $input"
+
+    # A second compile with --cache must load the code from the cache and print the same listing
+    "$compiler" --quiet --cache="$workdir/cache" "$input" "$workdir/$name.cached.txt"
+    "$compiler" --quiet --cache="$workdir/cache" --stats "$input" "$workdir/$name.cached.txt" 2> "$workdir/$name.stats"
+    cmp -s "$workdir/$name.txt" "$workdir/$name.cached.txt" && grep -q "cache: 1 hits" "$workdir/$name.stats"
+    check $? "cached compile $input"
+
+    # Statistics as JSON must be one object on one line
+    "$compiler" --quiet --stats=json "$input" "$workdir/$name.json.txt" 2> "$workdir/$name.json"
+    [ "$(wc -l < "$workdir/$name.json")" = 1 ] && grep -q '^{"seconds": {"read": .*}$' "$workdir/$name.json"
+    check $? "stats json $input"
+
+    # Optimized code must print the same output and stop with the same status as the plain code
+    printf '3\n5\n7\n' | "$compiler" --quiet --run "$input" "$workdir/$name.txt" > "$workdir/$name.run" 2>&1
+    echo "exit $?" >> "$workdir/$name.run"
+    printf '3\n5\n7\n' | "$compiler" --quiet --run --optimize "$input" "$workdir/$name.optimized.txt" > "$workdir/$name.optimized.run" 2>&1
+    echo "exit $?" >> "$workdir/$name.optimized.run"
+    cmp -s "$workdir/$name.run" "$workdir/$name.optimized.run"
+    check $? "optimized run $input"
+
+    # So must code with only common subexpressions reused
+    printf '3\n5\n7\n' | "$compiler" --quiet --run --common-subexprs "$input" "$workdir/$name.cse.txt" > "$workdir/$name.cse.run" 2>&1
+    echo "exit $?" >> "$workdir/$name.cse.run"
+    cmp -s "$workdir/$name.run" "$workdir/$name.cse.run"
+    check $? "common subexpressions run $input"
+
+    # And code with only the unreachable blocks removed
+    printf '3\n5\n7\n' | "$compiler" --quiet --run --remove-dead-code "$input" "$workdir/$name.dead.txt" > "$workdir/$name.dead.run" 2>&1
+    echo "exit $?" >> "$workdir/$name.dead.run"
+    cmp -s "$workdir/$name.run" "$workdir/$name.dead.run"
+    check $? "dead code removed run $input"
+
+    # And code with only the dead stores removed, or only the loads of known constants replaced
+    for pass in dead-stores constant-loads
+    do
+        printf '3\n5\n7\n' | "$compiler" --quiet --run --$pass "$input" "$workdir/$name.$pass.txt" > "$workdir/$name.$pass.run" 2>&1
+        echo "exit $?" >> "$workdir/$name.$pass.run"
+        cmp -s "$workdir/$name.run" "$workdir/$name.$pass.run"
+        check $? "$pass run $input"
+    done
+
+    # Native code from the JIT must print the same output and stop with the same status as the interpreter
+    printf '3\n5\n7\n' | "$compiler" --quiet --run --jit "$input" "$workdir/$name.jit.txt" > "$workdir/$name.jit.run" 2>&1
+    echo "exit $?" >> "$workdir/$name.jit.run"
+    cmp -s "$workdir/$name.run" "$workdir/$name.jit.run"
+    check $? "jit run $input"
+
+    # Both the interpreter and the JIT must run the fused branch opcodes as the comparisons and JPCs they replace
+    for backend in run jit
+    do
+        printf '3\n5\n7\n' | "$compiler" --quiet --run --$backend --fuse-branches "$input" "$workdir/$name.fused.txt" \
+            > "$workdir/$name.fused.$backend.run" 2>&1
+        echo "exit $?" >> "$workdir/$name.fused.$backend.run"
+        cmp -s "$workdir/$name.run" "$workdir/$name.fused.$backend.run"
+        check $? "fused branches $backend $input"
+    done
+
+    # The program written as C and compiled natively must print the same output and stop with the same status too
+    if command -v "${CC:-cc}" > /dev/null
+    then
+        "$compiler" --quiet --emit-c="$workdir/$name.c" "$input" "$workdir/$name.c.txt"
+        "${CC:-cc}" -O2 -o "$workdir/$name.native" "$workdir/$name.c"
+        printf '3\n5\n7\n' | "$workdir/$name.native" > "$workdir/$name.native.run" 2>&1
+        echo "exit $?" >> "$workdir/$name.native.run"
+        cmp -s "$workdir/$name.run" "$workdir/$name.native.run"
+        check $? "emitted C run $input"
+    fi
+done
+
+# Generated programs must print the same output with each of these passes as without
+for seed in $(seq 1 50)
+do
+    random_program "$seed" > "$workdir/generated$seed.txt"
+    run_generated "$workdir/generated$seed.txt" > "$workdir/generated$seed.run"
+    run_generated "$workdir/generated$seed.txt" --common-subexprs > "$workdir/generated$seed.cse.run"
+    cmp -s "$workdir/generated$seed.run" "$workdir/generated$seed.cse.run"
+    check $? "common subexpressions run of generated program $seed"
+    run_generated "$workdir/generated$seed.txt" --remove-dead-code > "$workdir/generated$seed.dead.run"
+    cmp -s "$workdir/generated$seed.run" "$workdir/generated$seed.dead.run"
+    check $? "dead code removed run of generated program $seed"
+    for pass in dead-stores constant-loads hoist-invariants
+    do
+        run_generated "$workdir/generated$seed.txt" --$pass > "$workdir/generated$seed.$pass.run"
+        cmp -s "$workdir/generated$seed.run" "$workdir/generated$seed.$pass.run"
+        check $? "$pass run of generated program $seed"
+    done
+    for backend in run jit
+    do
+        run_generated "$workdir/generated$seed.txt" --$backend --fuse-branches > "$workdir/generated$seed.fused.$backend.run"
+        cmp -s "$workdir/generated$seed.run" "$workdir/generated$seed.fused.$backend.run"
+        check $? "fused branches $backend of generated program $seed"
+    done
+done
+
+# The control flow graph of test8.txt, with its nested loops and constant conditions, must match the committed one in
+# both formats
+for format in txt dot
+do
+    "$compiler" --quiet --dump-cfg="$workdir/cfg8.$format" test8.txt "$workdir/test8.cfg.txt" > /dev/null 2>&1
+    cmp -s cfg8out.$format "$workdir/cfg8.$format"
+    check $? "control flow graph of test8.txt in $format"
+done
+
+# Compiling them all at once with --batch must write the same listings as compiling each on its own
+"$compiler" --batch="$workdir/batch.list" --jobs=4 > /dev/null
+while read -r input output
+do
+    cmp -s "$workdir/$(basename "${input%.txt}").txt" "$output"
+    check $? "batch $input"
+done < "$workdir/batch.list"
+
+# A --serve process must answer a stream of requests with the same listings, and the same binary objects for the
+# programs that compile, as compiling each file on its own, even though it reuses its buffers from one to the next
+for input in test*.txt error?.txt error??.txt
+do
+    printf 'listing %d\n' "$(wc -c < "$input")"
+    cat "$input"
+    printf 'binary %d\n' "$(wc -c < "$input")"
+    cat "$input"
+done > "$workdir/requests"
+"$compiler" --serve < "$workdir/requests" > "$workdir/responses"
+check $? "serve"
+for input in test*.txt error?.txt error??.txt
+do
+    name=${input%.txt}
+    read -r status length
+    dd bs=1 count="$length" status=none > "$workdir/served.txt"
+    read -r status length
+    dd bs=1 count="$length" status=none > "$workdir/served.bin"
+    "$compiler" --quiet "$input" "$workdir/compiled.txt" < /dev/null
+    cmp -s "$workdir/compiled.txt" "$workdir/served.txt"
+    check $? "served listing $input"
+    if [ -f "$workdir/$name.bin" ]
+    then
+        cmp -s "$workdir/$name.bin" "$workdir/served.bin"
+        check $? "served binary $input"
+    fi
+done < "$workdir/responses"
+
+# The library must compile each program to the same listing, or stop with the same error, as the compiler
+if command -v "${CC:-cc}" > /dev/null && [ -f parsercodegen.c ]
+then
+    cat > "$workdir/library.c" <<'EOF'
+#include <stdio.h>
+#include "parsercodegen.h"
+
+// Compile a file with pl0_compile and print what the compiler would have printed
+int main(int argc, char *argv[])
+{
+    static char source[1 << 20];
+    FILE *file = fopen(argv[1], "rb");
+    size_t length = fread(source, 1, sizeof(source), file);
+    fclose(file);
+
+    const char *names[] = {"", "LIT", "OPR", "LOD", "STO", "CAL", "INC", "JMP", "JPC", "SYS",
+                           "JNE", "JEQ", "JGE", "JGT", "JLE", "JLT", "JEV"};
+    pl0_result result;
+    if (pl0_compile(source, length, &result) != 0)
+    {
+        if (result.error.code != PL0_LEXER_ERROR) // The compiler stops silently at a scanner error
+            printf("Error: %s\n", result.error.message);
+        return 1;
+    }
+    printf("Assembly Code:\n%10s %10s %10s %10s\n", "Line", "OP", "L", "M");
+    for (int i = 0; i < result.num_instructions; i++)
+        printf("%10d %10s %10d %10d\n", i, names[result.code[i].op], result.code[i].l, result.code[i].m);
+    printf("\nSymbol Table:\n%10s | %10s | %10s | %10s | %10s | %10s\n", "Kind", "Name", "Value", "Level", "Address",
+           "Mark");
+    printf("    -----------------------------------------------------------------------\n");
+    for (int i = 0; i < result.num_symbols; i++)
+    {
+        pl0_symbol *s = &result.symbols[i];
+        if (s->kind == 1)
+            printf("%10d | %10s | %10d | %10s | %10s | %10d\n", s->kind, s->name, s->val, "-", "-", s->mark);
+        else
+            printf("%10d | %10s | %10d | %10d | %10d | %10d\n", s->kind, s->name, s->val, s->level, s->addr, s->mark);
+    }
+    pl0_free_result(&result);
+    return 0;
+}
+EOF
+    "${CC:-cc}" -O2 -DPL0_LIBRARY -I. -o "$workdir/library" "$workdir/library.c" parsercodegen.c -pthread
+    for input in test*.txt error?.txt error??.txt
+    do
+        "$compiler" --quiet "$input" "$workdir/compiled.txt"
+        "$workdir/library" "$input" > "$workdir/library.txt"
+        cmp -s "$workdir/compiled.txt" "$workdir/library.txt"
+        check $? "library compile $input"
+    done
+fi
+
+exit $failures